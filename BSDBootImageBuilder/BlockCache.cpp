@@ -0,0 +1,154 @@
+#include "BlockCache.h"
+#include "lz4.h"
+#include "xxhash.h"
+
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<unsigned int> temporaryCounter(0);
+
+static uint32_t readLE32(const unsigned char *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+BlockCache::BlockCache() {
+
+}
+
+BlockCache::BlockCache(const std::string &directory) : m_directory(directory) {
+#ifdef _WIN32
+	int result = _mkdir(directory.c_str());
+#else
+	int result = mkdir(directory.c_str(), 0777);
+#endif
+	if (result != 0 && errno != EEXIST) {
+		std::stringstream error;
+		error << "Cannot create block cache directory " << directory;
+		throw std::runtime_error(error.str());
+	}
+}
+
+BlockCache::~BlockCache() {
+
+}
+
+std::string BlockCache::key(const unsigned char *data, size_t size, uint64_t settingsHash) const {
+	char key[32];
+	snprintf(key, sizeof(key), "%016llx-%zx", static_cast<unsigned long long>(XXH64(data, size, settingsHash)), size);
+	return key;
+}
+
+std::string BlockCache::entryFileName(const std::string &key) const {
+	return m_directory + "/" + key + ".lz4b";
+}
+
+bool BlockCache::fetch(const std::string &key, const unsigned char *data, size_t size, bool blockChecksum, std::vector<unsigned char> &block) const {
+	if (m_directory.empty()) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			auto it = m_blocks.find(key);
+			if (it == m_blocks.end())
+				return false;
+
+			it->second.used = true;
+			block = it->second.block;
+		}
+
+		return blockMatches(block, data, size, blockChecksum);
+	}
+
+	std::ifstream stream(entryFileName(key), std::ios::in | std::ios::binary | std::ios::ate);
+	if (!stream)
+		return false;
+
+	auto length = stream.tellg();
+	if (length < 4)
+		return false;
+
+	block.resize(static_cast<size_t>(length));
+	stream.seekg(0);
+	if (!stream.read(reinterpret_cast<char *>(block.data()), block.size()))
+		return false;
+
+	return blockMatches(block, data, size, blockChecksum);
+}
+
+bool BlockCache::blockMatches(const std::vector<unsigned char> &block, const unsigned char *data, size_t size, bool blockChecksum) {
+	uint32_t header = readLE32(block.data());
+	uint32_t payloadSize = header & 0x7FFFFFFF;
+	bool uncompressed = (header & 0x80000000) != 0;
+
+	if (block.size() != 4 + payloadSize + (blockChecksum ? 4 : 0))
+		return false;
+
+	const unsigned char *payload = block.data() + 4;
+
+	if (blockChecksum && readLE32(payload + payloadSize) != XXH32(payload, payloadSize, 0))
+		return false;
+
+	if (uncompressed)
+		return payloadSize == size && memcmp(payload, data, size) == 0;
+
+	std::vector<unsigned char> decompressed(size);
+	int result = LZ4_decompress_safe(reinterpret_cast<const char *>(payload), reinterpret_cast<char *>(decompressed.data()),
+		static_cast<int>(payloadSize), static_cast<int>(size));
+
+	return result == static_cast<int>(size) && memcmp(decompressed.data(), data, size) == 0;
+}
+
+void BlockCache::store(const std::string &key, const std::vector<unsigned char> &block) const {
+	if (m_directory.empty()) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_blocks[key] = MemoryEntry{ block, true };
+		return;
+	}
+
+	auto entry = entryFileName(key);
+
+	std::stringstream temporary;
+#ifdef _WIN32
+	temporary << entry << ".tmp" << _getpid() << "." << temporaryCounter++;
+#else
+	temporary << entry << ".tmp" << getpid() << "." << temporaryCounter++;
+#endif
+
+	{
+		std::ofstream stream;
+		stream.exceptions(std::ios::failbit | std::ios::badbit);
+		stream.open(temporary.str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		stream.write(reinterpret_cast<const char *>(block.data()), block.size());
+	}
+
+	if (rename(temporary.str().c_str(), entry.c_str()) != 0) {
+		remove(temporary.str().c_str());
+	}
+}
+
+void BlockCache::trim() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	for (auto it = m_blocks.begin(); it != m_blocks.end();) {
+		if (it->second.used) {
+			it->second.used = false;
+			++it;
+		}
+		else {
+			it = m_blocks.erase(it);
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef BLOCK_CACHE__H
+#define BLOCK_CACHE__H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk cache of compressed LZ4 frame blocks, keyed by a hash of the
+ * uncompressed block contents and of the settings that affect block
+ * compression. Fetched blocks are decompressed and compared against the
+ * uncompressed data before being used, so a hash collision can never
+ * produce a corrupted image.
+ *
+ * A cache constructed without a directory is held in memory instead, for
+ * processes that build the same image repeatedly (see --watch).
+ */
+class BlockCache {
+public:
+	BlockCache();
+	explicit BlockCache(const std::string &directory);
+	~BlockCache();
+
+	BlockCache(const BlockCache &other) = delete;
+	BlockCache &operator =(const BlockCache &other) = delete;
+
+	std::string key(const unsigned char *data, size_t size, uint64_t settingsHash) const;
+
+	bool fetch(const std::string &key, const unsigned char *data, size_t size, bool blockChecksum, std::vector<unsigned char> &block) const;
+	void store(const std::string &key, const std::vector<unsigned char> &block) const;
+
+	/*
+	 * Drops the blocks of a memory cache that have been neither fetched
+	 * nor stored since the previous call, so that the cache only holds
+	 * blocks of the latest build.
+	 */
+	void trim();
+
+private:
+	struct MemoryEntry {
+		std::vector<unsigned char> block;
+		bool used;
+	};
+
+	std::string entryFileName(const std::string &key) const;
+
+	static bool blockMatches(const std::vector<unsigned char> &block, const unsigned char *data, size_t size, bool blockChecksum);
+
+	std::string m_directory;
+	mutable std::mutex m_mutex;
+	mutable std::unordered_map<std::string, MemoryEntry> m_blocks; // Without a directory
+};
+
+#endif
@@ -1,11 +1,21 @@
 #include "Blueprint.h"
 
+#include "lz4hc.h"
+
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 #include <unordered_map>
 
-Blueprint::Blueprint() : compress(false) {
+Blueprint::Blueprint() : compress(false), sparseMinimumGap(0), symbolFilter(SymbolFilter::All), stripDebug(false), prelink(false), resolveDependencies(false), pack(false) {
+	compression.level = LZ4HC_CLEVEL_MAX;
+	compression.blockSize = 64 * 1024;
+	compression.favorDecompressionSpeed = false;
+	compression.contentChecksum = false;
+	compression.blockChecksum = false;
+	compression.moduleAlignedBlocks = false;
+	compression.moduleFrames = false;
+	compression.skipIncompressible = false;
 
 }
 
@@ -16,11 +26,42 @@ Blueprint::~Blueprint() {
 void Blueprint::parse(const std::string &filename) {
 	std::ifstream stream;
 	stream.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
+	sourceFiles.push_back(filename);
 	stream.open(filename, std::ios::in);
 	parse(stream);
 }
 
+std::vector<std::string> Blueprint::inputFiles() const {
+	std::vector<std::string> files;
+
+	files.push_back(kickstart);
+	files.insert(files.end(), initModules.begin(), initModules.end());
+
+	for (const auto &mod : modules) {
+		files.push_back(mod.fileName);
+
+		for (const auto &metadata : mod.metadata) {
+			if (metadata.type == ModuleMetadataType::DTB)
+				files.push_back(metadata.singleValue);
+		}
+	}
+
+	return files;
+}
+
+void Blueprint::define(const std::string &name, const std::string &value) {
+	m_definitions[name] = value;
+}
+
 void Blueprint::parse(std::istream &stream) {
+	ParsingContext ctx;
+	ctx.state = ParsingContext::StateRoot;
+	ctx.includeDepth = 0;
+
+	parse(stream, ctx);
+}
+
+void Blueprint::parse(std::istream &stream, ParsingContext &ctx) {
 	stream.exceptions(std::ios::badbit);
 
 	enum {
@@ -35,9 +76,6 @@ void Blueprint::parse(std::istream &stream) {
 	char character;
 	bool tokenBufferActive = false;
 
-	ParsingContext ctx;
-	ctx.state = ParsingContext::StateRoot;
-
 	while (true) {
 		stream.get(character);
 
@@ -115,6 +153,93 @@ void Blueprint::parse(std::istream &stream) {
 		throw std::runtime_error("No newline at the end of file");
 }
 
+/*
+ * Included files are parsed as if their lines appeared in place of the
+ * INCLUDE line, in the same context, so that fragments may also hold e.g.
+ * metadata or environment entries.
+ */
+void Blueprint::include(const std::string &filename, ParsingContext &ctx) {
+	if (ctx.includeDepth == MaximumIncludeDepth) {
+		std::stringstream error;
+		error << "Too many nested includes at " << filename;
+		throw std::runtime_error(error.str());
+	}
+
+	sourceFiles.push_back(filename);
+
+	std::ifstream stream(filename, std::ios::in);
+	if (!stream) {
+		std::stringstream error;
+		error << "Cannot open included file " << filename;
+		throw std::runtime_error(error.str());
+	}
+
+	ctx.includeDepth++;
+
+	try {
+		parse(stream, ctx);
+	}
+	catch (const std::exception &e) {
+		std::stringstream error;
+		error << filename << ": " << e.what();
+		throw std::runtime_error(error.str());
+	}
+
+	ctx.includeDepth--;
+}
+
+/*
+ * Replaces every %name% in the token with the value of the variable, and
+ * every %% with a single %.
+ */
+std::string Blueprint::expand(const std::string &token) const {
+	std::string result;
+	size_t position = 0;
+
+	while (true) {
+		size_t start = token.find('%', position);
+		if (start == std::string::npos)
+			break;
+
+		size_t end = token.find('%', start + 1);
+		if (end == std::string::npos) {
+			std::stringstream error;
+			error << "Unterminated variable reference in '" << token << "'";
+			throw std::runtime_error(error.str());
+		}
+
+		result.append(token, position, start - position);
+
+		auto name = token.substr(start + 1, end - start - 1);
+		if (name.empty()) {
+			result.push_back('%');
+		}
+		else {
+			auto it = m_definitions.find(name);
+			if (it == m_definitions.end()) {
+				it = m_variables.find(name);
+
+				if (it == m_variables.end()) {
+					std::stringstream error;
+					error << "Undefined variable '" << name << "'";
+					throw std::runtime_error(error.str());
+				}
+			}
+
+			result.append(it->second);
+		}
+
+		position = end + 1;
+	}
+
+	if (position == 0)
+		return token;
+
+	result.append(token, position, std::string::npos);
+
+	return result;
+}
+
 void Blueprint::processLine(std::vector<std::string> &&line, ParsingContext &ctx) {
 	enum class MetadataValueType {
 		None,
@@ -129,11 +254,38 @@ void Blueprint::processLine(std::vector<std::string> &&line, ParsingContext &ctx
 		{ "ENVIRONMENT", { ModuleMetadataType::ENVIRONMENT, MetadataValueType::Multiple } },
 	};
 
+	for (auto &token : line) {
+		token = expand(token);
+	}
+
 	auto controlToken = line[0];
 
 	auto it = line.begin() + 1;
 	auto end = line.end();
 
+	/*
+	 * Variables and includes are handled the same way in every context.
+	 */
+	if (controlToken == "DEFINE") {
+		if (it == end)
+			throw std::runtime_error("Variable name expected");
+
+		auto name = std::move(*it++);
+
+		if (it == end)
+			throw std::runtime_error("Variable value expected");
+
+		m_variables[name] = std::move(*it++);
+		return;
+	}
+	else if (controlToken == "INCLUDE") {
+		if (it == end)
+			throw std::runtime_error("File name expected");
+
+		include(*it, ctx);
+		return;
+	}
+
 	switch (ctx.state) {
 	case ParsingContext::StateRoot:
 		if (controlToken == "MODULE") {
@@ -154,13 +306,19 @@ void Blueprint::processLine(std::vector<std::string> &&line, ParsingContext &ctx
 				throw std::runtime_error("Module file name expected");
 
 			mod.fileName = std::move(*it++);
+			mod.noCompress = false;
 
-			if (it != end) {
+			while (it != end) {
 				auto controlToken = std::move(*it++);
-				if(controlToken != "METADATA")
-					throw std::runtime_error("'METADATA' or end of line is expected");
-
-				ctx.state = ParsingContext::StateMetadata;
+				if (controlToken == "NOCOMPRESS") {
+					mod.noCompress = true;
+				}
+				else if (controlToken == "METADATA" && it == end) {
+					ctx.state = ParsingContext::StateMetadata;
+				}
+				else {
+					throw std::runtime_error("'NOCOMPRESS', 'METADATA' or end of line is expected");
+				}
 			}
 		}
 		else if (controlToken == "IMAGE_BASE") {
@@ -183,6 +341,44 @@ void Blueprint::processLine(std::vector<std::string> &&line, ParsingContext &ctx
 			initModules.emplace_back(std::move(*it++));
 		} else if(controlToken == "COMPRESS") {
 			compress = true;
+			parseCompressionSettings(it, end);
+		}
+		else if (controlToken == "SPARSE") {
+			sparseMinimumGap = 64 * 1024;
+
+			if (it != end) {
+				sparseMinimumGap = std::stoul(*it++, nullptr, 0);
+
+				if (sparseMinimumGap < 4096)
+					throw std::runtime_error("Minimum sparse gap must be at least 4096 bytes");
+			}
+		}
+		else if (controlToken == "PACK") {
+			pack = true;
+		}
+		else if (controlToken == "RESOLVE_DEPENDENCIES") {
+			resolveDependencies = true;
+		}
+		else if (controlToken == "PRELINK") {
+			prelink = true;
+		}
+		else if (controlToken == "STRIP_DEBUG") {
+			stripDebug = true;
+		}
+		else if (controlToken == "SYMBOLS") {
+			if (it == end)
+				throw std::runtime_error("'ALL', 'NODEBUG' or 'GLOBAL' expected after SYMBOLS");
+
+			auto filter = std::move(*it++);
+
+			if (filter == "ALL")
+				symbolFilter = SymbolFilter::All;
+			else if (filter == "NODEBUG")
+				symbolFilter = SymbolFilter::NoDebug;
+			else if (filter == "GLOBAL")
+				symbolFilter = SymbolFilter::Global;
+			else
+				throw std::runtime_error("'ALL', 'NODEBUG' or 'GLOBAL' expected after SYMBOLS");
 		}
 		else {
 			std::stringstream error;
@@ -256,3 +452,79 @@ void Blueprint::processLine(std::vector<std::string> &&line, ParsingContext &ctx
 		break;
 	}
 }
+
+static bool parseSwitch(const std::string &option, const std::string &value) {
+	if (value == "on" || value == "ON")
+		return true;
+	else if (value == "off" || value == "OFF")
+		return false;
+
+	std::stringstream error;
+	error << "'on' or 'off' expected after " << option << ", got '" << value << "'";
+	throw std::runtime_error(error.str());
+}
+
+void Blueprint::parseCompressionSettings(std::vector<std::string>::iterator it, std::vector<std::string>::iterator end) {
+	static const std::unordered_map<std::string, uint32_t> blockSizes{
+		{ "64KB", 64 * 1024 },
+		{ "256KB", 256 * 1024 },
+		{ "1MB", 1024 * 1024 },
+		{ "4MB", 4 * 1024 * 1024 },
+	};
+
+	while (it != end) {
+		auto option = std::move(*it++);
+
+		if (option == "FAVOR_DECSPEED") {
+			compression.favorDecompressionSpeed = true;
+			continue;
+		}
+		else if (option == "MODULE_BLOCKS") {
+			compression.moduleAlignedBlocks = true;
+			continue;
+		}
+		else if (option == "MODULE_FRAMES") {
+			compression.moduleFrames = true;
+			continue;
+		}
+		else if (option == "SKIP_INCOMPRESSIBLE") {
+			compression.skipIncompressible = true;
+			continue;
+		}
+
+		if (it == end) {
+			std::stringstream error;
+			error << "Value expected after " << option;
+			throw std::runtime_error(error.str());
+		}
+
+		auto value = std::move(*it++);
+
+		if (option == "LEVEL") {
+			compression.level = std::stoi(value, nullptr, 0);
+			if (compression.level > LZ4HC_CLEVEL_MAX) {
+				std::stringstream error;
+				error << "Compression level must not exceed " << LZ4HC_CLEVEL_MAX;
+				throw std::runtime_error(error.str());
+			}
+		}
+		else if (option == "BLOCKSIZE") {
+			auto sizeIt = blockSizes.find(value);
+			if (sizeIt == blockSizes.end())
+				throw std::runtime_error("Block size must be one of 64KB, 256KB, 1MB or 4MB");
+
+			compression.blockSize = sizeIt->second;
+		}
+		else if (option == "CHECKSUM") {
+			compression.contentChecksum = parseSwitch(option, value);
+		}
+		else if (option == "BLOCK_CHECKSUM") {
+			compression.blockChecksum = parseSwitch(option, value);
+		}
+		else {
+			std::stringstream error;
+			error << "Invalid compression option: '" << option << "'";
+			throw std::runtime_error(error.str());
+		}
+	}
+}
@@ -1,7 +1,10 @@
 #ifndef BLUEPRINT__H
 #define BLUEPRINT__H
 
+#include <stdint.h>
+
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 enum class ModuleMetadataType {
@@ -17,10 +20,28 @@ struct ModuleMetadata {
 	std::vector<std::pair<std::string, std::string>> keyValuePairs; // ENVIRONMENT
 };
 
+enum class SymbolFilter {
+	All, // Symbol tables are loaded as they are
+	NoDebug, // Without section, file, mapping and local label symbols
+	Global // Only global and weak symbols, and functions
+};
+
+struct CompressionSettings {
+	int level;
+	uint32_t blockSize; // 64 KiB, 256 KiB, 1 MiB or 4 MiB
+	bool favorDecompressionSpeed;
+	bool contentChecksum;
+	bool blockChecksum;
+	bool moduleAlignedBlocks; // Start a new frame block at every module boundary
+	bool moduleFrames; // Compress every module as a separate frame
+	bool skipIncompressible; // Store blocks that fast LZ4 cannot shrink uncompressed
+};
+
 struct Module {
 	std::string name;
 	std::string type;
 	std::string fileName;
+	bool noCompress;
 	std::vector<ModuleMetadata> metadata;
 };
 
@@ -32,6 +53,13 @@ public:
 	Blueprint(const Blueprint &other) = delete;
 	Blueprint &operator =(const Blueprint &other) = delete;
 
+	/*
+	 * Defines a variable for %name% substitution. Variables defined here
+	 * take precedence over DEFINE directives of the blueprint, so they
+	 * must be defined before parsing.
+	 */
+	void define(const std::string &name, const std::string &value);
+
 	void parse(const std::string &filename);
 	void parse(std::istream &stream);
 
@@ -40,6 +68,20 @@ public:
 	std::string kickstart;
 	std::vector<std::string> initModules;
 	bool compress;
+	CompressionSettings compression;
+	uint32_t sparseMinimumGap; // 0 unless SPARSE is specified
+	SymbolFilter symbolFilter;
+	bool stripDebug; // Remove debug sections from loaded segments
+	bool prelink; // Relocate ELF modules at build time
+	bool resolveDependencies; // Check and order modules by their MDT_DEPEND metadata
+	bool pack; // Use minimal payload alignments
+	std::vector<std::string> sourceFiles; // The blueprint file and every file included by it
+
+	/*
+	 * Returns the names of all input files referenced by the blueprint:
+	 * kickstart, initialization modules, modules and DTBs.
+	 */
+	std::vector<std::string> inputFiles() const;
 
 private:
 	struct ParsingContext {
@@ -48,9 +90,20 @@ private:
 			StateMetadata,
 			StateValues
 		} state;
+
+		unsigned int includeDepth;
 	};
 
+	static const unsigned int MaximumIncludeDepth = 16;
+
+	void parse(std::istream &stream, ParsingContext &ctx);
+	void include(const std::string &filename, ParsingContext &ctx);
+	std::string expand(const std::string &token) const;
 	void processLine(std::vector<std::string> &&line, ParsingContext &ctx);
+	void parseCompressionSettings(std::vector<std::string>::iterator it, std::vector<std::string>::iterator end);
+
+	std::unordered_map<std::string, std::string> m_definitions; // From define(), override m_variables
+	std::unordered_map<std::string, std::string> m_variables; // From DEFINE
 };
 
 #endif
@@ -0,0 +1,160 @@
+#include "BootCostModel.h"
+#include "Layout.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+void BootProfile::parse(const std::string &spec) {
+	std::stringstream stream(spec);
+	std::string item;
+
+	while (std::getline(stream, item, ',')) {
+		auto separator = item.find('=');
+		if (separator == std::string::npos)
+			throw std::runtime_error("Boot profile entry '" + item + "' is not of the form name=value");
+
+		auto name = item.substr(0, separator);
+		auto value = item.substr(separator + 1);
+
+		size_t suffix;
+		double bandwidth = std::stod(value, &suffix);
+
+		if (suffix < value.size()) {
+			auto unit = value.substr(suffix);
+
+			if (unit == "K" || unit == "k")
+				bandwidth *= 1e3;
+			else if (unit == "M" || unit == "m")
+				bandwidth *= 1e6;
+			else if (unit == "G" || unit == "g")
+				bandwidth *= 1e9;
+			else
+				throw std::runtime_error("Invalid bandwidth suffix: " + unit);
+		}
+
+		if (bandwidth <= 0)
+			throw std::runtime_error("Bandwidth must be positive: " + item);
+
+		if (name == "flash")
+			flashBandwidth = bandwidth;
+		else if (name == "memory")
+			memoryBandwidth = bandwidth;
+		else if (name == "lz4")
+			decompressionBandwidth = bandwidth;
+		else
+			throw std::runtime_error("Unknown boot profile entry: " + name);
+	}
+}
+
+BootCostModel::BootCostModel(const Layout &layout, const BootProfile &profile) : m_layout(layout), m_profile(profile) {
+
+}
+
+BootCostModel::~BootCostModel() {
+
+}
+
+void BootCostModel::addSegment(uint32_t address, uint64_t fileSize, uint64_t memorySize) {
+	m_segments.push_back(Segment{ address, fileSize, memorySize });
+}
+
+void BootCostModel::addBlock(size_t offset, size_t size, size_t compressedSize, bool stored) {
+	m_blocks.push_back(Block{ offset, size, compressedSize, stored });
+}
+
+void BootCostModel::print() const {
+	static const char *const typeNames[] = {
+		"module",
+		"dtb",
+		"environment",
+		"metadata"
+	};
+
+	logPrintf("Boot cost estimate: flash %.1f MB/s, memory %.1f MB/s, LZ4 %.1f MB/s\n",
+		m_profile.flashBandwidth / 1e6, m_profile.memoryBandwidth / 1e6, m_profile.decompressionBandwidth / 1e6);
+
+	/*
+	 * Boot loader phase: every segment is read from flash, and the rest
+	 * of its memory size is zeroed.
+	 */
+
+	logPrintf("  %-8s %10s %10s %10s\n", "SEGMENT", "FILE SIZE", "MEM SIZE", "LOAD (ms)");
+
+	double loadSeconds = 0;
+	uint64_t flashBytes = 0;
+
+	for (const auto &segment : m_segments) {
+		double seconds = segment.fileSize / m_profile.flashBandwidth +
+			(segment.memorySize - segment.fileSize) / m_profile.memoryBandwidth;
+
+		logPrintf("  %08X %10" PRIu64 " %10" PRIu64 " %10.3f\n", segment.address, segment.fileSize, segment.memorySize, seconds * 1000);
+
+		loadSeconds += seconds;
+		flashBytes += segment.fileSize;
+	}
+
+	/*
+	 * Per region: bytes it occupies in flash and time to decompress it.
+	 * Bytes that belong to no region (padding, frame headers, the
+	 * kickstart) only show up in the totals.
+	 */
+
+	logPrintf("  %-12s %-20s %10s %10s %10s %10s %11s\n", "TYPE", "NAME", "SIZE", "SYMBOLS", "FLASH", "LOAD (ms)", "DECODE (ms)");
+
+	double decodeSeconds = 0;
+	for (const auto &block : m_blocks) {
+		decodeSeconds += block.size / (block.stored ? m_profile.memoryBandwidth : m_profile.decompressionBandwidth);
+	}
+
+	uint64_t symbolBytes = 0;
+	uint64_t metadataBytes = 0;
+
+	for (const auto &region : m_layout.regions) {
+		size_t start = region.base - m_layout.imageBase;
+		size_t end = start + region.size;
+		double flash = 0;
+		double decode = 0;
+
+		if (m_blocks.empty()) {
+			for (const auto &segment : m_segments) {
+				size_t segmentStart = segment.address - m_layout.imageBase;
+				size_t from = std::max(start, segmentStart);
+				size_t to = std::min<size_t>(end, segmentStart + segment.fileSize);
+
+				if (segment.address >= m_layout.imageBase && from < to)
+					flash += to - from;
+			}
+		}
+		else {
+			for (const auto &block : m_blocks) {
+				size_t from = std::max(start, block.offset);
+				size_t to = std::min(end, block.offset + block.size);
+
+				if (from < to) {
+					double share = static_cast<double>(to - from) / block.size;
+					flash += block.compressedSize * share;
+					decode += (to - from) / (block.stored ? m_profile.memoryBandwidth : m_profile.decompressionBandwidth);
+				}
+			}
+		}
+
+		uint32_t symbols = region.symbolsEnd - region.symbolsStart;
+		symbolBytes += symbols;
+
+		if (region.type == LayoutRegionType::Metadata)
+			metadataBytes += region.size;
+
+		logPrintf("  %-12s %-20s %10u %10u %10.0f %10.3f %11.3f\n",
+			typeNames[static_cast<int>(region.type)], region.name.c_str(), region.size, symbols, flash,
+			flash / m_profile.flashBandwidth * 1000, decode * 1000);
+	}
+
+	logPrintf("  Symbol tables: %" PRIu64 " bytes, metadata: %" PRIu64 " bytes\n", symbolBytes, metadataBytes);
+	logPrintf("  Estimated boot: %" PRIu64 " bytes loaded in %.3f ms, decompression %.3f ms, %.3f ms in total\n",
+		flashBytes, loadSeconds * 1000, decodeSeconds * 1000, (loadSeconds + decodeSeconds) * 1000);
+}
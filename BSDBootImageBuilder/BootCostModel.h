@@ -0,0 +1,77 @@
+#ifndef BOOT_COST_MODEL__H
+#define BOOT_COST_MODEL__H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class Layout;
+
+/*
+ * Speeds of the target that determine how long the boot takes, in bytes
+ * per second. The defaults are ballpark figures for a Zynq-7000 booting
+ * from quad SPI flash; measure the actual target and override them.
+ */
+struct BootProfile {
+	BootProfile() : flashBandwidth(20e6), memoryBandwidth(300e6), decompressionBandwidth(100e6) {
+
+	}
+
+	/*
+	 * Parses a comma separated list of name=value pairs, where name is
+	 * one of flash, memory and lz4, e.g. "flash=40M,lz4=150M". Values
+	 * accept K, M and G suffixes.
+	 */
+	void parse(const std::string &spec);
+
+	double flashBandwidth; // Of the boot loader copying PT_LOAD segments from flash
+	double memoryBandwidth; // Of copying stored LZ4 blocks and zeroing memory
+	double decompressionBandwidth; // Of LZ4 decoding, in decompressed bytes per second
+};
+
+/*
+ * Estimates the time spent by the boot loader and the kickstart before the
+ * kernel gets control, from the layout and the shape of the output file,
+ * and attributes it to layout regions.
+ */
+class BootCostModel {
+public:
+	BootCostModel(const Layout &layout, const BootProfile &profile);
+	~BootCostModel();
+
+	/*
+	 * A PT_LOAD segment of the output. Bytes between fileSize and
+	 * memorySize are zeroed by the boot loader.
+	 */
+	void addSegment(uint32_t address, uint64_t fileSize, uint64_t memorySize);
+
+	/*
+	 * An LZ4 block of a compressed image, offset relative to the image
+	 * base. Stored blocks are only copied by the decoder.
+	 */
+	void addBlock(size_t offset, size_t size, size_t compressedSize, bool stored);
+
+	void print() const;
+
+private:
+	struct Segment {
+		uint32_t address;
+		uint64_t fileSize;
+		uint64_t memorySize;
+	};
+
+	struct Block {
+		size_t offset;
+		size_t size;
+		size_t compressedSize;
+		bool stored;
+	};
+
+	const Layout &m_layout;
+	BootProfile m_profile;
+	std::vector<Segment> m_segments;
+	std::vector<Block> m_blocks;
+};
+
+#endif
@@ -0,0 +1,638 @@
+#include "BootEmulator.h"
+#include "ExtentLoader.h"
+#include "FileProvider.h"
+#include "FreeBSDTypes.h"
+#include "InputFile.h"
+#include "Log.h"
+#include "Layout.h"
+#include "elf32.h"
+#include "xxhash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t ElfIdentification[EI_NIDENT] = {
+	ELFMAG0,
+	ELFMAG1,
+	ELFMAG2,
+	ELFMAG3,
+	ELFCLASS32,
+	ELFDATA2LSB,
+	EV_CURRENT
+};
+
+static const uint8_t UnloadedMemoryPattern = 0xA5; // Memory not covered by any segment is not zero on real hardware
+static const size_t CompareWindowSize = 16 * 1024 * 1024;
+static const unsigned int MaximumInitModules = 64;
+
+static uint32_t readLE32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+BootEmulator::BootEmulator(const std::string &fileName, const Layout &layout, FileProvider &files) : m_fileName(fileName), m_layout(layout), m_files(files),
+	m_memoryBase(0), m_entry(0), m_kickstartBase(0), m_kickstartSize(0), m_failures(0) {
+
+}
+
+BootEmulator::~BootEmulator() {
+
+}
+
+bool BootEmulator::run(WorkerPool &pool) {
+	logPrintf("Verifying %s\n", m_fileName.c_str());
+
+	try {
+		loadSegments();
+		decompress();
+		checkKickstart();
+		checkMetadata();
+		checkContents(pool);
+	}
+	catch (const std::exception &e) {
+		fail("%s", e.what());
+	}
+
+	if (!m_timings.empty())
+		reportThroughput();
+
+	if (m_failures == 0)
+		logPrintf("Verification passed\n");
+	else
+		logPrintf("Verification failed: %u problems found\n", m_failures);
+
+	return m_failures == 0;
+}
+
+void BootEmulator::loadSegments() {
+	InputFile file(m_fileName);
+
+	auto ehdr = file.read<Elf32_Ehdr>(0);
+	if (memcmp(ehdr.e_ident, ElfIdentification, EI_PAD) != 0 ||
+		ehdr.e_type != ET_EXEC ||
+		ehdr.e_machine != EM_ARM ||
+		ehdr.e_phentsize != sizeof(Elf32_Phdr))
+		throw std::runtime_error("Bad ELF identification");
+
+	auto phdrs = file.readArray<Elf32_Phdr>(ehdr.e_phoff, ehdr.e_phnum);
+
+	uint64_t low = m_layout.imageBase;
+	uint64_t high = m_layout.imageBase + m_layout.imageSize;
+
+	for (const auto &phdr : phdrs) {
+		if (phdr.p_type == PT_LOAD) {
+			low = std::min<uint64_t>(low, phdr.p_paddr);
+			high = std::max<uint64_t>(high, static_cast<uint64_t>(phdr.p_paddr) + phdr.p_memsz);
+		}
+	}
+
+	m_memoryBase = static_cast<uint32_t>(low);
+	m_memory.assign(static_cast<size_t>(high - low), UnloadedMemoryPattern);
+	m_entry = ehdr.e_entry;
+
+	for (const auto &phdr : phdrs) {
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		if (phdr.p_filesz > phdr.p_memsz)
+			fail("Segment at %08X has a file size larger than its memory size", phdr.p_paddr);
+
+		auto target = memory(phdr.p_paddr, phdr.p_memsz);
+		memcpy(target, file.view(phdr.p_offset, phdr.p_filesz), phdr.p_filesz);
+		memset(target + phdr.p_filesz, 0, phdr.p_memsz - phdr.p_filesz);
+
+		if (m_entry >= phdr.p_paddr && m_entry < phdr.p_paddr + phdr.p_memsz) {
+			m_kickstartBase = phdr.p_paddr;
+			m_kickstartSize = phdr.p_memsz;
+		}
+	}
+
+	if (m_kickstartSize == 0)
+		throw std::runtime_error("Entry point is not inside any segment");
+
+	logPrintf("  Kickstart segment at %08X, size %08X, entry %08X\n", m_kickstartBase, m_kickstartSize, m_entry);
+}
+
+void BootEmulator::decompress() {
+	uint32_t source = word(m_kickstartBase + 8);
+	uint32_t destination = word(m_kickstartBase + 12);
+
+	if (destination != m_layout.imageBase)
+		fail("Kickstart destination %08X is not the image base %08X", destination, m_layout.imageBase);
+
+	if (source == 0) {
+		uint32_t table = word(m_kickstartBase + 20);
+		unsigned int frames = 0;
+
+		logPrintf("  Decompressing frames listed at %08X\n", table);
+
+		for (uint32_t entry = table; word(entry) != 0; entry += 16, frames++) {
+			uint32_t frameSource = word(entry);
+			uint32_t frameSourceSize = word(entry + 4);
+			uint32_t frameDestination = word(entry + 8);
+			uint32_t frameSize = word(entry + 12);
+
+			uint32_t consumed;
+			uint32_t size = decompressFrame(frameSource, frameDestination, consumed);
+
+			if (consumed != frameSourceSize)
+				fail("Frame at %08X is %08X bytes long, table says %08X", frameSource, consumed, frameSourceSize);
+
+			if (size != frameSize)
+				fail("Frame at %08X decompresses to %08X bytes, table says %08X", frameSource, size, frameSize);
+		}
+
+		logPrintf("  %u frames decompressed\n", frames);
+	}
+	else if (source != destination) {
+		logPrintf("  Decompressing image from %08X to %08X\n", source, destination);
+
+		uint32_t consumed;
+		uint32_t size = decompressFrame(source, destination, consumed);
+
+		if (size != m_layout.imageSize)
+			fail("Image decompresses to %08X bytes instead of %08zX", size, m_layout.imageSize);
+	}
+	else {
+		logPrintf("  Image is not compressed\n");
+	}
+}
+
+uint32_t BootEmulator::decompressFrame(uint32_t source, uint32_t destination, uint32_t &consumed) {
+	/*
+	 * Decoding works directly on the emulated memory, reading the input
+	 * strictly forward and writing the output strictly forward, exactly as
+	 * an in-place decoder does; input that is overwritten before it is
+	 * read corrupts the result.
+	 */
+
+	uint8_t *ip = memory(source, 7);
+	uint8_t *const memoryEnd = m_memory.data() + m_memory.size();
+	uint8_t *const outputStart = memory(destination, 0);
+	uint8_t *op = outputStart;
+
+	if (readLE32(ip) != 0x184D2204)
+		throw std::runtime_error("No LZ4 frame at the compressed image address");
+
+	uint8_t flags = ip[4];
+	size_t headerSize = 7 + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+	bool blockChecksum = (flags & 0x10) != 0;
+	bool contentChecksum = (flags & 0x04) != 0;
+
+	if ((flags & 0xC0) != 0x40 || (flags & 0x20) == 0)
+		throw std::runtime_error("Unsupported LZ4 frame: not version 01 with independent blocks");
+
+	if (static_cast<size_t>(memoryEnd - ip) < headerSize + 4)
+		throw std::runtime_error("Truncated LZ4 frame");
+
+	ip += headerSize;
+
+	XXH32_state_t *state = XXH32_createState();
+	XXH32_reset(state, 0);
+
+	try {
+		while (true) {
+			if (memoryEnd - ip < 4)
+				throw std::runtime_error("Truncated LZ4 frame");
+
+			uint32_t header = readLE32(ip);
+			ip += 4;
+
+			uint32_t size = header & 0x7FFFFFFF;
+			if (size == 0)
+				break;
+
+			if (static_cast<size_t>(memoryEnd - ip) < size + (blockChecksum ? 4 : 0))
+				throw std::runtime_error("Truncated LZ4 block");
+
+			uint32_t expectedChecksum = blockChecksum ? XXH32(ip, size, 0) : 0;
+			uint8_t *blockOutput = op;
+
+			auto start = std::chrono::steady_clock::now();
+
+			if (header & 0x80000000) {
+				if (static_cast<size_t>(memoryEnd - op) < size)
+					throw std::runtime_error("LZ4 block overruns memory");
+
+				for (uint32_t index = 0; index < size; index++) {
+					op[index] = ip[index];
+				}
+
+				op += size;
+			}
+			else {
+				decompressBlock(ip, size, op);
+			}
+
+			auto end = std::chrono::steady_clock::now();
+
+			m_timings.push_back(BlockTiming{
+				static_cast<uint32_t>(blockOutput - m_memory.data()) + m_memoryBase,
+				static_cast<uint32_t>(op - blockOutput),
+				size + 4,
+				std::chrono::duration<double>(end - start).count() });
+
+			ip += size;
+
+			if (blockChecksum) {
+				if (readLE32(ip) != expectedChecksum)
+					fail("Block checksum mismatch for the block decompressed to %08X", m_timings.back().destination);
+
+				ip += 4;
+			}
+
+			if (contentChecksum)
+				XXH32_update(state, blockOutput, op - blockOutput);
+		}
+
+		if (contentChecksum) {
+			if (memoryEnd - ip < 4)
+				throw std::runtime_error("Truncated LZ4 frame");
+
+			if (readLE32(ip) != XXH32_digest(state))
+				fail("Content checksum mismatch for the frame at %08X", source);
+
+			ip += 4;
+		}
+	}
+	catch (...) {
+		XXH32_freeState(state);
+		throw;
+	}
+
+	XXH32_freeState(state);
+
+	consumed = static_cast<uint32_t>(ip - memory(source, 0));
+
+	return static_cast<uint32_t>(op - outputStart);
+}
+
+void BootEmulator::decompressBlock(const uint8_t *source, size_t size, uint8_t *&output) {
+	const uint8_t *ip = source;
+	const uint8_t *const end = source + size;
+	uint8_t *op = output;
+	uint8_t *const blockStart = output;
+	uint8_t *const memoryEnd = m_memory.data() + m_memory.size();
+
+	auto readLength = [&](size_t length) {
+		if (length == 15) {
+			uint8_t byte;
+			do {
+				if (ip == end)
+					throw std::runtime_error("Malformed LZ4 block: truncated length");
+
+				byte = *ip++;
+				length += byte;
+			} while (byte == 255);
+		}
+
+		return length;
+	};
+
+	while (true) {
+		if (ip == end)
+			throw std::runtime_error("Malformed LZ4 block: missing sequence");
+
+		uint8_t token = *ip++;
+
+		size_t literals = readLength(token >> 4);
+		if (static_cast<size_t>(end - ip) < literals || static_cast<size_t>(memoryEnd - op) < literals)
+			throw std::runtime_error("Malformed LZ4 block: literals overrun");
+
+		if (op + literals <= ip || op >= ip + literals) {
+			memmove(op, ip, literals);
+		}
+		else {
+			for (size_t index = 0; index < literals; index++) {
+				op[index] = ip[index];
+			}
+		}
+
+		ip += literals;
+		op += literals;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			throw std::runtime_error("Malformed LZ4 block: truncated offset");
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match = readLength(token & 15) + 4;
+
+		if (offset == 0 || offset > static_cast<size_t>(op - blockStart))
+			throw std::runtime_error("Malformed LZ4 block: bad match offset");
+
+		if (static_cast<size_t>(memoryEnd - op) < match)
+			throw std::runtime_error("Malformed LZ4 block: match overrun");
+
+		const uint8_t *from = op - offset;
+		if (offset >= match) {
+			memcpy(op, from, match);
+		}
+		else {
+			for (size_t index = 0; index < match; index++) {
+				op[index] = from[index];
+			}
+		}
+
+		op += match;
+	}
+
+	output = op;
+}
+
+void BootEmulator::checkKickstart() {
+	uint32_t kernelEntry = word(m_kickstartBase + 4);
+	uint32_t imageEnd = m_layout.imageBase + static_cast<uint32_t>(m_layout.imageSize);
+
+	if (kernelEntry < m_layout.imageBase || kernelEntry >= imageEnd)
+		fail("Kernel entry point %08X is outside of the image", kernelEntry);
+
+	uint32_t initTable = word(m_kickstartBase + 16);
+	if (initTable != 0) {
+		unsigned int count = 0;
+
+		for (uint32_t entry = initTable; word(entry) != 0; entry += 4, count++) {
+			uint32_t initEntry = word(entry);
+
+			if (initEntry < m_kickstartBase || initEntry >= m_kickstartBase + m_kickstartSize)
+				fail("Init module entry point %08X is outside of the kickstart segment", initEntry);
+
+			if (count == MaximumInitModules) {
+				fail("Init module table at %08X is not terminated", initTable);
+				break;
+			}
+		}
+
+		logPrintf("  %u init modules\n", count);
+	}
+}
+
+void BootEmulator::checkMetadata() {
+	uint32_t delta = m_layout.kernelDelta;
+	uint32_t address = word(m_kickstartBase) + delta;
+
+	const LayoutRegion *metadataRegion = nullptr;
+	std::vector<const LayoutRegion *> modules;
+
+	for (const auto &region : m_layout.regions) {
+		if (region.type == LayoutRegionType::Metadata)
+			metadataRegion = &region;
+		else if (region.type == LayoutRegionType::Module)
+			modules.push_back(&region);
+	}
+
+	if (!metadataRegion || address != metadataRegion->base) {
+		fail("Metadata pointer %08X does not point to the metadata", address - delta);
+		return;
+	}
+
+	auto findRegion = [this](LayoutRegionType type, const std::string &name) -> const LayoutRegion * {
+		for (const auto &region : m_layout.regions) {
+			if (region.type == type && region.name == name)
+				return &region;
+		}
+
+		return nullptr;
+	};
+
+	uint32_t end = metadataRegion->base + metadataRegion->size;
+	size_t moduleIndex = 0;
+	const LayoutRegion *current = nullptr;
+	bool terminated = false;
+
+	while (address + 8 <= end) {
+		uint32_t type = word(address);
+		uint32_t size = word(address + 4);
+		uint32_t data = address + 8;
+
+		if (size > end - data) {
+			fail("Metadata record at %08X overruns the metadata", address);
+			return;
+		}
+
+		uint32_t value = size >= 4 ? word(data) : 0;
+		address = data + ((size + 3) & ~3);
+
+		if (type == MODINFO_END) {
+			terminated = true;
+			break;
+		}
+		else if (type == MODINFO_NAME) {
+			std::string name(reinterpret_cast<const char *>(memory(data, size)), strnlen(reinterpret_cast<const char *>(memory(data, size)), size));
+
+			if (moduleIndex >= modules.size() || modules[moduleIndex]->name != name) {
+				fail("Unexpected module '%s' in the metadata", name.c_str());
+				current = nullptr;
+			}
+			else {
+				current = modules[moduleIndex];
+			}
+
+			moduleIndex++;
+			continue;
+		}
+
+		if (!current)
+			continue;
+
+		const char *name = current->name.c_str();
+
+		switch (type) {
+		case MODINFO_ADDR:
+			if (value + delta != current->base)
+				fail("%s: MODINFO_ADDR is %08X, module is at %08X", name, value + delta, current->base);
+			break;
+
+		case MODINFO_SIZE:
+			if (value != current->size)
+				fail("%s: MODINFO_SIZE is %08X, module is %08X bytes", name, value, current->size);
+			break;
+
+		case MODINFO_METADATA | MODINFOMD_SSYM:
+			if (value + delta != current->symbolsStart)
+				fail("%s: SSYM is %08X, symbols start at %08X", name, value + delta, current->symbolsStart);
+			break;
+
+		case MODINFO_METADATA | MODINFOMD_ESYM:
+			if (value + delta != current->symbolsEnd)
+				fail("%s: ESYM is %08X, symbols end at %08X", name, value + delta, current->symbolsEnd);
+			break;
+
+		case MODINFO_METADATA | MODINFOMD_DTBP:
+		{
+			auto region = findRegion(LayoutRegionType::DTB, current->name);
+			if (!region || value + delta != region->base) {
+				fail("%s: DTBP %08X does not point to the DTB", name, value + delta);
+			}
+			else if (readLE32(memory(region->base, 4)) != 0xEDFE0DD0) {
+				fail("%s: no device tree magic at %08X", name, region->base);
+			}
+			break;
+		}
+
+		case MODINFO_METADATA | MODINFOMD_ENVP:
+		{
+			auto region = findRegion(LayoutRegionType::Environment, current->name);
+			if (!region || value + delta != region->base) {
+				fail("%s: ENVP %08X does not point to the environment", name, value + delta);
+			}
+			else {
+				auto environment = memory(region->base, region->size);
+				if (region->size < 1 || environment[region->size - 1] != 0 || (region->size >= 2 && environment[region->size - 2] != 0))
+					fail("%s: environment at %08X is not terminated", name, region->base);
+			}
+			break;
+		}
+
+		case MODINFO_METADATA | MODINFOMD_KERNEND:
+		{
+			uint32_t imageEnd = m_layout.imageBase + static_cast<uint32_t>(m_layout.imageSize);
+			if (value + delta != imageEnd)
+				fail("%s: KERNEND is %08X, image ends at %08X", name, value + delta, imageEnd);
+			break;
+		}
+		}
+	}
+
+	if (!terminated)
+		fail("Metadata is not terminated by MODINFO_END");
+
+	if (moduleIndex != modules.size())
+		fail("Metadata describes %zu modules, layout has %zu", moduleIndex, modules.size());
+
+	logPrintf("  Metadata at %08X describes %zu modules\n", metadataRegion->base, moduleIndex);
+}
+
+void BootEmulator::checkContents(WorkerPool &pool) {
+	/*
+	 * Everything from the start of the first region up to the end of the
+	 * image must match the layout. Memory below the first region may be
+	 * left unloaded by sparse images.
+	 */
+
+	size_t start = m_layout.imageSize;
+	for (const auto &region : m_layout.regions) {
+		start = std::min<size_t>(start, region.base - m_layout.imageBase);
+	}
+
+	ExtentLoader loader(m_layout.extents, m_files, pool);
+	std::vector<uint8_t> window;
+
+	for (size_t offset = start; offset < m_layout.imageSize; offset += window.size()) {
+		window.resize(std::min(CompareWindowSize, m_layout.imageSize - offset));
+		loader.load(offset, window.data(), window.size());
+
+		for (const auto &extent : m_layout.extents) {
+			size_t from = std::max(offset, extent.offset);
+			size_t to = std::min(offset + window.size(), extent.offset + extent.size);
+
+			if (extent.direct && from < to) {
+				auto file = m_files.open(extent.fileName);
+				memcpy(window.data() + from - offset, file->view(extent.fileOffset + from - extent.offset, to - from), to - from);
+			}
+		}
+
+		auto actual = memory(m_layout.imageBase + static_cast<uint32_t>(offset), static_cast<uint32_t>(window.size()));
+
+		if (memcmp(actual, window.data(), window.size()) != 0) {
+			size_t position = 0;
+			while (actual[position] == window[position]) {
+				position++;
+			}
+
+			uint32_t address = m_layout.imageBase + static_cast<uint32_t>(offset + position);
+			const char *owner = "padding";
+
+			for (const auto &region : m_layout.regions) {
+				if (address >= region.base && address < region.base + region.size)
+					owner = region.name.c_str();
+			}
+
+			fail("Image contents differ from the layout at %08X (%s)", address, owner);
+			return;
+		}
+	}
+
+	logPrintf("  Image contents match the layout\n");
+}
+
+void BootEmulator::reportThroughput() const {
+	static const char *const typeNames[] = {
+		"module",
+		"dtb",
+		"environment",
+		"metadata"
+	};
+
+	logPrintf("  %-12s %-20s %10s %10s %10s %10s\n", "TYPE", "NAME", "SIZE", "PACKED", "TIME (ms)", "MB/s");
+
+	double totalSeconds = 0;
+	uint64_t totalSize = 0;
+
+	for (const auto &region : m_layout.regions) {
+		double seconds = 0;
+		double packed = 0;
+		uint64_t size = 0;
+
+		for (const auto &timing : m_timings) {
+			uint32_t from = std::max(timing.destination, region.base);
+			uint32_t to = std::min(timing.destination + timing.size, region.base + region.size);
+
+			if (from < to && timing.size != 0) {
+				double share = static_cast<double>(to - from) / timing.size;
+				seconds += timing.seconds * share;
+				packed += timing.compressedSize * share;
+				size += to - from;
+			}
+		}
+
+		logPrintf("  %-12s %-20s %10" PRIu64 " %10.0f %10.3f %10.1f\n",
+			typeNames[static_cast<int>(region.type)], region.name.c_str(), size, packed, seconds * 1000,
+			seconds > 0 ? size / seconds / 1e6 : 0.0);
+	}
+
+	for (const auto &timing : m_timings) {
+		totalSeconds += timing.seconds;
+		totalSize += timing.size;
+	}
+
+	logPrintf("  Host decompression: %" PRIu64 " bytes in %.3f ms, %.1f MB/s\n", totalSize, totalSeconds * 1000,
+		totalSeconds > 0 ? totalSize / totalSeconds / 1e6 : 0.0);
+}
+
+void BootEmulator::fail(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+
+	logPrintf("  FAILED: ");
+	logVprintf(format, args);
+	logPrintf("\n");
+
+	va_end(args);
+
+	m_failures++;
+}
+
+uint8_t *BootEmulator::memory(uint32_t address, uint32_t size) {
+	if (address < m_memoryBase || static_cast<uint64_t>(address) + size > static_cast<uint64_t>(m_memoryBase) + m_memory.size()) {
+		std::stringstream error;
+		error << "Access to " << std::hex << address << ", " << std::dec << size << " bytes, is outside of the loaded memory";
+		throw std::runtime_error(error.str());
+	}
+
+	return m_memory.data() + (address - m_memoryBase);
+}
+
+uint32_t BootEmulator::word(uint32_t address) {
+	return readLE32(memory(address, 4));
+}
@@ -0,0 +1,71 @@
+#ifndef BOOT_EMULATOR__H
+#define BOOT_EMULATOR__H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class FileProvider;
+class Layout;
+class WorkerPool;
+
+/*
+ * Boots an output image on the host, as far as the kickstart is concerned:
+ * loads the PT_LOAD segments of the ELF file into an emulated physical
+ * memory, decompresses the image in place as described by the kickstart
+ * information words, and then checks the result against the layout the
+ * image was built from: image contents, read from the input files through
+ * the given provider, kickstart information, and every address in the
+ * preload metadata. Decompression is timed, and the throughput is
+ * reported for every layout region.
+ */
+class BootEmulator {
+public:
+	BootEmulator(const std::string &fileName, const Layout &layout, FileProvider &files);
+	~BootEmulator();
+
+	BootEmulator(const BootEmulator &other) = delete;
+	BootEmulator &operator =(const BootEmulator &other) = delete;
+
+	/*
+	 * Returns true if all checks passed. Failures are printed as they are
+	 * found.
+	 */
+	bool run(WorkerPool &pool);
+
+private:
+	struct BlockTiming {
+		uint32_t destination;
+		uint32_t size;
+		uint32_t compressedSize;
+		double seconds;
+	};
+
+	void loadSegments();
+	void decompress();
+	uint32_t decompressFrame(uint32_t source, uint32_t destination, uint32_t &consumed);
+	void decompressBlock(const uint8_t *source, size_t size, uint8_t *&output);
+	void checkKickstart();
+	void checkMetadata();
+	void checkContents(WorkerPool &pool);
+	void reportThroughput() const;
+
+	void fail(const char *format, ...);
+
+	uint8_t *memory(uint32_t address, uint32_t size);
+	uint32_t word(uint32_t address);
+
+	const std::string m_fileName;
+	const Layout &m_layout;
+	FileProvider &m_files;
+	std::vector<uint8_t> m_memory;
+	uint32_t m_memoryBase;
+	uint32_t m_entry;
+	uint32_t m_kickstartBase;
+	uint32_t m_kickstartSize;
+	std::vector<BlockTiming> m_timings;
+	unsigned int m_failures;
+};
+
+#endif
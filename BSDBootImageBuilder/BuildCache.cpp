@@ -0,0 +1,215 @@
+#include "BuildCache.h"
+#include "Blueprint.h"
+#include "BuildOptions.h"
+#include "FileProvider.h"
+#include "InputFile.h"
+#include "xxhash.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Must be incremented whenever a change to the builder changes the output
+ * produced from the same inputs, to invalidate existing cache entries.
+ */
+static const uint64_t CacheFormatVersion = 2;
+
+static std::atomic<unsigned int> temporaryCounter(0);
+
+namespace {
+	struct XXH64Deleter {
+		inline void operator()(XXH64_state_t *state) const {
+			XXH64_freeState(state);
+		}
+	};
+
+	class Hasher {
+	public:
+		explicit Hasher(FileProvider &files) : m_files(files), m_state(XXH64_createState()) {
+			if (!m_state)
+				throw std::bad_alloc();
+
+			XXH64_reset(m_state.get(), 0);
+		}
+
+		void add(const void *data, size_t size) {
+			XXH64_update(m_state.get(), data, size);
+		}
+
+		void add(uint64_t value) {
+			add(&value, sizeof(value));
+		}
+
+		void add(const std::string &string) {
+			add(static_cast<uint64_t>(string.size()));
+			add(string.data(), string.size());
+		}
+
+		void addFile(const std::string &filename) {
+			add(filename);
+
+			auto file = m_files.open(filename);
+			uint64_t size = file->size();
+
+			if (size != 0)
+				add(file->view(0, size), static_cast<size_t>(size));
+
+			add(size);
+		}
+
+		uint64_t digest() const {
+			return XXH64_digest(m_state.get());
+		}
+
+	private:
+		FileProvider &m_files;
+		std::unique_ptr<XXH64_state_t, XXH64Deleter> m_state;
+	};
+}
+
+static void copyFile(const std::string &source, const std::string &destination) {
+	std::ifstream input;
+	input.exceptions(std::ios::badbit);
+	input.open(source, std::ios::in | std::ios::binary);
+
+	std::ofstream output;
+	output.exceptions(std::ios::failbit | std::ios::badbit);
+	output.open(destination, std::ios::out | std::ios::trunc | std::ios::binary);
+
+	output << input.rdbuf();
+}
+
+BuildCache::BuildCache(const std::string &directory) : m_directory(directory) {
+#ifdef _WIN32
+	int result = _mkdir(directory.c_str());
+#else
+	int result = mkdir(directory.c_str(), 0777);
+#endif
+	if (result != 0 && errno != EEXIST) {
+		std::stringstream error;
+		error << "Cannot create cache directory " << directory;
+		throw std::runtime_error(error.str());
+	}
+}
+
+BuildCache::~BuildCache() {
+
+}
+
+std::string BuildCache::key(const Blueprint &blueprint, const BuildOptions &options, FileProvider &files) const {
+	Hasher hasher(files);
+
+	hasher.add(CacheFormatVersion);
+
+	/*
+	 * Streamed images reserve room for in-place decompression up front,
+	 * which places the kickstart differently.
+	 */
+	hasher.add(options.maxMemory != 0);
+	hasher.add(blueprint.imageBase);
+	hasher.add(blueprint.compress);
+	hasher.add(static_cast<uint64_t>(blueprint.compression.level));
+	hasher.add(blueprint.compression.blockSize);
+	hasher.add(blueprint.compression.favorDecompressionSpeed);
+	hasher.add(blueprint.compression.contentChecksum);
+	hasher.add(blueprint.compression.blockChecksum);
+	hasher.add(blueprint.compression.moduleAlignedBlocks);
+	hasher.add(blueprint.compression.moduleFrames);
+	hasher.add(blueprint.compression.skipIncompressible);
+	hasher.add(blueprint.sparseMinimumGap);
+	hasher.add(static_cast<uint64_t>(blueprint.symbolFilter));
+	hasher.add(blueprint.stripDebug);
+	hasher.add(blueprint.prelink);
+	hasher.add(blueprint.resolveDependencies);
+	hasher.add(blueprint.pack);
+
+	hasher.addFile(blueprint.kickstart);
+
+	hasher.add(blueprint.initModules.size());
+	for (const auto &initModule : blueprint.initModules) {
+		hasher.addFile(initModule);
+	}
+
+	hasher.add(blueprint.modules.size());
+	for (const auto &mod : blueprint.modules) {
+		hasher.add(mod.name);
+		hasher.add(mod.type);
+		hasher.addFile(mod.fileName);
+		hasher.add(mod.noCompress);
+
+		hasher.add(mod.metadata.size());
+		for (const auto &metadata : mod.metadata) {
+			hasher.add(static_cast<uint64_t>(metadata.type));
+
+			if (metadata.type == ModuleMetadataType::DTB)
+				hasher.addFile(metadata.singleValue);
+			else
+				hasher.add(metadata.singleValue);
+
+			hasher.add(metadata.keyValuePairs.size());
+			for (const auto &pair : metadata.keyValuePairs) {
+				hasher.add(pair.first);
+				hasher.add(pair.second);
+			}
+		}
+	}
+
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hasher.digest()));
+	return key;
+}
+
+std::string BuildCache::entryFileName(const std::string &key) const {
+	return m_directory + "/" + key + ".elf";
+}
+
+bool BuildCache::fetch(const std::string &key, const std::string &outputFile) const {
+	auto entry = entryFileName(key);
+
+	{
+		std::ifstream probe(entry, std::ios::in | std::ios::binary);
+		if (!probe)
+			return false;
+	}
+
+	copyFile(entry, outputFile);
+
+	return true;
+}
+
+void BuildCache::store(const std::string &key, const std::string &outputFile) const {
+	/*
+	 * Entries are written under a temporary name and then renamed, so that
+	 * concurrent builds never observe a partially written entry.
+	 */
+
+	auto entry = entryFileName(key);
+
+	std::stringstream temporary;
+#ifdef _WIN32
+	temporary << entry << ".tmp" << _getpid() << "." << temporaryCounter++;
+#else
+	temporary << entry << ".tmp" << getpid() << "." << temporaryCounter++;
+#endif
+
+	copyFile(outputFile, temporary.str());
+
+	if (rename(temporary.str().c_str(), entry.c_str()) != 0) {
+		remove(temporary.str().c_str());
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef BUILD_CACHE__H
+#define BUILD_CACHE__H
+
+#include <string>
+
+class Blueprint;
+struct BuildOptions;
+class FileProvider;
+
+/*
+ * Content-addressed cache of complete output images. The key of an entry is
+ * an XXH64 hash of the parsed blueprint, the contents of every file it
+ * references and the build options that affect the layout, so an entry
+ * can only be hit by a build that would produce exactly the same output.
+ */
+class BuildCache {
+public:
+	explicit BuildCache(const std::string &directory);
+	~BuildCache();
+
+	BuildCache(const BuildCache &other) = delete;
+	BuildCache &operator =(const BuildCache &other) = delete;
+
+	std::string key(const Blueprint &blueprint, const BuildOptions &options, FileProvider &files) const;
+
+	bool fetch(const std::string &key, const std::string &outputFile) const;
+	void store(const std::string &key, const std::string &outputFile) const;
+
+private:
+	std::string entryFileName(const std::string &key) const;
+
+	std::string m_directory;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef BUILD_OPTIONS__H
+#define BUILD_OPTIONS__H
+
+#include <string>
+#include <stddef.h>
+
+#include "BootCostModel.h"
+
+/*
+ * Settings that control how an image is built, as opposed to what goes
+ * into it (which is described by the Blueprint). None of these options
+ * change the contents of the produced image, except that streaming
+ * (maxMemory) reserves room past the end of a compressed image, which
+ * places the kickstart higher.
+ */
+struct BuildOptions {
+	BuildOptions() : jobs(0), maxMemory(0), dryRun(false), verify(false), bootReport(false) {
+
+	}
+
+	unsigned int jobs; // Number of worker threads, 0 for one per hardware thread.
+	std::string cacheDirectory; // Whole-build cache location, empty to disable.
+	std::string blockCacheDirectory; // Compressed block cache location, empty to disable.
+	size_t maxMemory; // Stream the image to the output within this many bytes, 0 to build it in memory.
+	bool dryRun; // Only plan and print the layout, without loading anything.
+	bool verify; // Boot the written image on the host and check it against the layout.
+	bool bootReport; // Print the boot time estimate of the written image.
+	BootProfile bootProfile; // Target speeds for the boot time estimate.
+};
+
+#endif
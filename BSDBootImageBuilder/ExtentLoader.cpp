@@ -0,0 +1,100 @@
+#include "ExtentLoader.h"
+#include "FileProvider.h"
+#include "InputFile.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+/*
+ * Copies larger than this are split, so that big payloads (e.g. ramdisks)
+ * are faulted in by several workers at once.
+ */
+static const size_t MaxReadSize = 4 * 1024 * 1024;
+
+ExtentLoader::ExtentLoader(const std::vector<LayoutExtent> &extents, FileProvider &files, WorkerPool &pool) :
+	m_extents(extents), m_pool(pool), m_overrides(extents.size(), false) {
+
+	std::vector<size_t> order(extents.size());
+	for (size_t index = 0; index < order.size(); index++) {
+		order[index] = index;
+	}
+
+	std::sort(order.begin(), order.end(), [&extents](size_t a, size_t b) {
+		return extents[a].offset < extents[b].offset;
+	});
+
+	for (const auto &extent : extents) {
+		if (!extent.fileName.empty() && !extent.direct && m_files.count(extent.fileName) == 0) {
+			auto file = files.open(extent.fileName);
+			file->adviseSequential();
+			m_files.emplace(extent.fileName, std::move(file));
+		}
+	}
+
+	for (size_t position = 0; position < order.size(); position++) {
+		const auto &extent = extents[order[position]];
+		size_t end = extent.offset + extent.size;
+
+		for (size_t next = position + 1; next < order.size() && extents[order[next]].offset < end; next++) {
+			m_overrides[std::max(order[position], order[next])] = true;
+		}
+	}
+}
+
+ExtentLoader::~ExtentLoader() {
+
+}
+
+void ExtentLoader::load(size_t offset, uint8_t *buffer, size_t size) {
+	memset(buffer, 0, size);
+
+	std::vector<WorkItem> items;
+	std::vector<WorkItem> overrides;
+
+	for (size_t index = 0; index < m_extents.size(); index++) {
+		const auto &extent = m_extents[index];
+
+		size_t start = std::max<size_t>(offset, extent.offset);
+		size_t end = std::min<size_t>(offset + size, extent.offset + extent.size);
+
+		if (start >= end || extent.direct)
+			continue;
+
+		const InputFile *file = nullptr;
+		if (!extent.fileName.empty()) {
+			file = m_files.at(extent.fileName).get();
+			file->adviseWillNeed(extent.fileOffset + (start - extent.offset), end - start);
+		}
+
+		if (m_overrides[index]) {
+			overrides.push_back(WorkItem{ &extent, file, start - extent.offset, end - start, buffer + start - offset });
+			continue;
+		}
+
+		for (size_t chunk = start; chunk < end; chunk += MaxReadSize) {
+			size_t chunkEnd = std::min(end, chunk + MaxReadSize);
+			items.push_back(WorkItem{ &extent, file, chunk - extent.offset, chunkEnd - chunk, buffer + chunk - offset });
+		}
+	}
+
+	m_pool.run(items.size(), [&items](size_t item, unsigned int) {
+		loadItem(items[item]);
+	});
+
+	for (const auto &item : overrides) {
+		loadItem(item);
+	}
+}
+
+void ExtentLoader::loadItem(const WorkItem &item) {
+	const auto &extent = *item.extent;
+
+	if (extent.fileName.empty()) {
+		memcpy(item.destination, extent.data.data() + item.extentOffset, item.size);
+	}
+	else {
+		memcpy(item.destination, item.file->view(extent.fileOffset + item.extentOffset, item.size), item.size);
+	}
+}
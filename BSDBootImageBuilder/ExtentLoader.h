@@ -0,0 +1,54 @@
+#ifndef EXTENT_LOADER__H
+#define EXTENT_LOADER__H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Layout.h"
+
+class FileProvider;
+class InputFile;
+class WorkerPool;
+
+/*
+ * Fills ranges of the uncompressed image from the extents of a layout.
+ * Extents that do not overlap any preceding extent are loaded concurrently
+ * on a worker pool, with large file extents split into chunks, so that
+ * several reads are in flight at once. The remaining extents, which
+ * override parts of preceding ones, are applied afterwards in layout order.
+ * Input files are opened once per loader and copied from directly. Direct
+ * extents are skipped and left zero; they are written to the output by the
+ * caller.
+ */
+class ExtentLoader {
+public:
+	ExtentLoader(const std::vector<LayoutExtent> &extents, FileProvider &files, WorkerPool &pool);
+	~ExtentLoader();
+
+	ExtentLoader(const ExtentLoader &other) = delete;
+	ExtentLoader &operator =(const ExtentLoader &other) = delete;
+
+	void load(size_t offset, uint8_t *buffer, size_t size);
+
+private:
+	struct WorkItem {
+		const LayoutExtent *extent;
+		const InputFile *file;
+		size_t extentOffset;
+		size_t size;
+		uint8_t *destination;
+	};
+
+	static void loadItem(const WorkItem &item);
+
+	const std::vector<LayoutExtent> &m_extents;
+	WorkerPool &m_pool;
+	std::vector<bool> m_overrides;
+	std::unordered_map<std::string, std::unique_ptr<InputFile>> m_files;
+};
+
+#endif
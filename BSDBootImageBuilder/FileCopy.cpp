@@ -0,0 +1,115 @@
+#include "FileCopy.h"
+#include "InputFile.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+static void readWriteCopy(const std::string &source, uint64_t sourceOffset,
+	const std::string &destination, uint64_t destinationOffset, uint64_t size) {
+
+	InputFile input(source);
+	auto data = input.view(sourceOffset, size);
+
+	std::fstream output;
+	output.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+	output.open(destination, std::ios::in | std::ios::out | std::ios::binary);
+	output.seekp(destinationOffset);
+	output.write(reinterpret_cast<const char *>(data), size);
+}
+
+#ifdef __linux__
+namespace {
+	class FileDescriptor {
+	public:
+		FileDescriptor(const std::string &fileName, int flags) : m_fd(open(fileName.c_str(), flags)) {
+			if (m_fd < 0) {
+				std::stringstream error;
+				error << "Cannot open " << fileName;
+				throw std::runtime_error(error.str());
+			}
+		}
+
+		~FileDescriptor() {
+			close(m_fd);
+		}
+
+		FileDescriptor(const FileDescriptor &other) = delete;
+		FileDescriptor &operator =(const FileDescriptor &other) = delete;
+
+		inline int fd() const {
+			return m_fd;
+		}
+
+	private:
+		int m_fd;
+	};
+}
+#endif
+
+FileCopyMethod copyFileRange(const std::string &source, uint64_t sourceOffset,
+	const std::string &destination, uint64_t destinationOffset, uint64_t size) {
+
+#ifdef __linux__
+	FileDescriptor input(source, O_RDONLY);
+	FileDescriptor output(destination, O_WRONLY);
+
+#ifdef FICLONERANGE
+	/*
+	 * Cloning requires block-aligned ranges and a file system that shares
+	 * extents (btrfs, XFS); any failure just falls through to copying.
+	 */
+	struct file_clone_range range;
+	range.src_fd = input.fd();
+	range.src_offset = sourceOffset;
+	range.src_length = size;
+	range.dest_offset = destinationOffset;
+
+	if (ioctl(output.fd(), FICLONERANGE, &range) == 0)
+		return FileCopyMethod::Clone;
+#endif
+
+	loff_t inputOffset = static_cast<loff_t>(sourceOffset);
+	loff_t outputOffset = static_cast<loff_t>(destinationOffset);
+	uint64_t remaining = size;
+
+	while (remaining > 0) {
+		ssize_t copied = copy_file_range(input.fd(), &inputOffset, output.fd(), &outputOffset, static_cast<size_t>(remaining), 0);
+
+		if (copied > 0) {
+			remaining -= static_cast<uint64_t>(copied);
+		}
+		else if (copied < 0 && errno == EINTR) {
+			continue;
+		}
+		else if (remaining == size && (copied == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			/*
+			 * Not supported between these files (older kernels refuse to copy
+			 * across file systems).
+			 */
+			break;
+		}
+		else {
+			std::stringstream error;
+			error << "Cannot copy " << source << " to " << destination;
+			throw std::runtime_error(error.str());
+		}
+	}
+
+	if (remaining == 0)
+		return FileCopyMethod::CopyFileRange;
+#endif
+
+	readWriteCopy(source, sourceOffset, destination, destinationOffset, size);
+
+	return FileCopyMethod::ReadWrite;
+}
@@ -0,0 +1,22 @@
+#ifndef FILE_COPY__H
+#define FILE_COPY__H
+
+#include <string>
+#include <stdint.h>
+
+enum class FileCopyMethod {
+	Clone, // Extents shared with the source file (reflink)
+	CopyFileRange, // Copied inside the kernel
+	ReadWrite // Copied through a memory mapping of the source
+};
+
+/*
+ * Copies size bytes at sourceOffset of the source file into the
+ * destination file at destinationOffset, which must already exist. Uses
+ * the cheapest method the platform and the file systems support, and
+ * returns which one was used.
+ */
+FileCopyMethod copyFileRange(const std::string &source, uint64_t sourceOffset,
+	const std::string &destination, uint64_t destinationOffset, uint64_t size);
+
+#endif
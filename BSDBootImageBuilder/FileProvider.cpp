@@ -0,0 +1,103 @@
+#include "FileProvider.h"
+#include "InputFile.h"
+
+#include <sstream>
+#include <stdexcept>
+
+class DiskFileProvider : public FileProvider {
+public:
+	virtual std::unique_ptr<InputFile> open(const std::string &fileName) override {
+		return std::unique_ptr<InputFile>(new InputFile(fileName));
+	}
+
+	virtual bool onDisk() const override {
+		return true;
+	}
+};
+
+FileProvider::~FileProvider() {
+
+}
+
+FileProvider &FileProvider::disk() {
+	static DiskFileProvider provider;
+
+	return provider;
+}
+
+MemoryFileProvider::MemoryFileProvider() {
+
+}
+
+MemoryFileProvider::~MemoryFileProvider() {
+
+}
+
+void MemoryFileProvider::add(const std::string &fileName, std::vector<uint8_t> &&data) {
+	auto &blob = m_blobs[fileName];
+	blob.storage = std::move(data);
+	blob.data = blob.storage.data();
+	blob.size = blob.storage.size();
+}
+
+void MemoryFileProvider::add(const std::string &fileName, const void *data, size_t size) {
+	auto &blob = m_blobs[fileName];
+	std::vector<uint8_t>().swap(blob.storage);
+	blob.data = static_cast<const uint8_t *>(data);
+	blob.size = size;
+}
+
+void MemoryFileProvider::remove(const std::string &fileName) {
+	m_blobs.erase(fileName);
+}
+
+std::unique_ptr<InputFile> MemoryFileProvider::open(const std::string &fileName) {
+	auto it = m_blobs.find(fileName);
+	if (it == m_blobs.end()) {
+		std::stringstream error;
+		error << "Cannot open " << fileName << ": no such input in memory";
+		throw std::runtime_error(error.str());
+	}
+
+	return std::unique_ptr<InputFile>(new InputFile(fileName, it->second.data, it->second.size));
+}
+
+bool MemoryFileProvider::onDisk() const {
+	return false;
+}
+
+SharedFileProvider::SharedFileProvider() : m_openCount(0) {
+
+}
+
+SharedFileProvider::~SharedFileProvider() {
+
+}
+
+std::unique_ptr<InputFile> SharedFileProvider::open(const std::string &fileName) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	auto &file = m_files[fileName];
+	if (!file) {
+		try {
+			file.reset(new InputFile(fileName));
+		}
+		catch (...) {
+			m_files.erase(fileName);
+			throw;
+		}
+	}
+
+	m_openCount++;
+
+	return std::unique_ptr<InputFile>(new InputFile(fileName, file->view(0, file->size()), file->size()));
+}
+
+bool SharedFileProvider::onDisk() const {
+	return true;
+}
+
+void SharedFileProvider::invalidate(const std::string &fileName) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_files.erase(fileName);
+}
@@ -0,0 +1,106 @@
+#ifndef FILE_PROVIDER__H
+#define FILE_PROVIDER__H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class InputFile;
+
+/*
+ * Source of the input files named by a blueprint: the kickstart, modules,
+ * DTBs and everything else that ends up in the image. Image opens inputs
+ * only through its file provider, so images can be built from files on
+ * disk as well as from blobs held in memory.
+ */
+class FileProvider {
+public:
+	virtual ~FileProvider();
+
+	/*
+	 * Returns the named input. Throws if there is no such input.
+	 */
+	virtual std::unique_ptr<InputFile> open(const std::string &fileName) = 0;
+
+	/*
+	 * Whether the inputs are files on disk, which the output may then be
+	 * cloned or copied from directly.
+	 */
+	virtual bool onDisk() const = 0;
+
+	/*
+	 * Provider of files on disk, used by default.
+	 */
+	static FileProvider &disk();
+};
+
+/*
+ * Serves inputs from memory, by name. Blobs added with a pointer are not
+ * copied and must outlive every build using the provider.
+ */
+class MemoryFileProvider : public FileProvider {
+public:
+	MemoryFileProvider();
+	virtual ~MemoryFileProvider();
+
+	MemoryFileProvider(const MemoryFileProvider &other) = delete;
+	MemoryFileProvider &operator =(const MemoryFileProvider &other) = delete;
+
+	void add(const std::string &fileName, std::vector<uint8_t> &&data);
+	void add(const std::string &fileName, const void *data, size_t size);
+	void remove(const std::string &fileName);
+
+	virtual std::unique_ptr<InputFile> open(const std::string &fileName) override;
+	virtual bool onDisk() const override;
+
+private:
+	struct Blob {
+		std::vector<uint8_t> storage;
+		const uint8_t *data;
+		size_t size;
+	};
+
+	std::unordered_map<std::string, Blob> m_blobs;
+};
+
+/*
+ * Opens every distinct file on disk once, and serves all further opens of
+ * it from the same mapping, so that builds of several images from the same
+ * inputs share them. May be used from several threads at once.
+ */
+class SharedFileProvider : public FileProvider {
+public:
+	SharedFileProvider();
+	virtual ~SharedFileProvider();
+
+	SharedFileProvider(const SharedFileProvider &other) = delete;
+	SharedFileProvider &operator =(const SharedFileProvider &other) = delete;
+
+	virtual std::unique_ptr<InputFile> open(const std::string &fileName) override;
+	virtual bool onDisk() const override;
+
+	/*
+	 * Forgets the file, so that it is opened again on the next use, e.g.
+	 * after it has changed. Must not be called while the file is in use.
+	 */
+	void invalidate(const std::string &fileName);
+
+	inline size_t fileCount() const {
+		return m_files.size();
+	}
+
+	inline size_t openCount() const {
+		return m_openCount;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::unordered_map<std::string, std::unique_ptr<InputFile>> m_files;
+	size_t m_openCount;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "FileWatcher.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher() : m_fd(-1) {
+#ifdef __linux__
+	m_fd = inotify_init1(IN_CLOEXEC);
+	if (m_fd < 0)
+		throw std::runtime_error("Cannot initialize inotify");
+#else
+	throw std::runtime_error("Watching files is not supported on this platform");
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef __linux__
+	close(m_fd);
+#endif
+}
+
+void FileWatcher::setFiles(const std::vector<std::string> &files) {
+#ifdef __linux__
+	std::unordered_map<int, std::string> directories;
+	std::unordered_map<std::string, std::string> names;
+
+	for (const auto &file : files) {
+		auto separator = file.rfind('/');
+		std::string directory;
+		std::string name;
+
+		if (separator == std::string::npos) {
+			directory = ".";
+			name = file;
+		}
+		else {
+			directory = separator == 0 ? "/" : file.substr(0, separator);
+			name = file.substr(separator + 1);
+		}
+
+		int wd = inotify_add_watch(m_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+		if (wd < 0) {
+			std::stringstream error;
+			error << "Cannot watch directory " << directory << " of " << file;
+			throw std::runtime_error(error.str());
+		}
+
+		/*
+		 * Several names may refer to the same directory, which then
+		 * has a single watch descriptor. Watching a directory again
+		 * returns its existing descriptor, under which events may
+		 * already be queued.
+		 */
+		auto &watched = directories[wd];
+		if (watched.empty()) {
+			auto existing = m_directories.find(wd);
+			watched = existing != m_directories.end() ? existing->second : directory;
+		}
+
+		names.emplace(watched + "/" + name, file);
+	}
+
+	for (const auto &directory : m_directories) {
+		if (directories.count(directory.first) == 0)
+			inotify_rm_watch(m_fd, directory.first);
+	}
+
+	m_directories = std::move(directories);
+	m_files = std::move(names);
+#else
+	(void)files;
+#endif
+}
+
+std::vector<std::string> FileWatcher::wait() {
+	std::vector<std::string> changed;
+
+#ifdef __linux__
+	alignas(struct inotify_event) char buffer[4096];
+
+	while (true) {
+		/*
+		 * Block until the first change, then collect the changes that
+		 * follow within the settle time.
+		 */
+		struct pollfd pfd;
+		pfd.fd = m_fd;
+		pfd.events = POLLIN;
+
+		int ready = poll(&pfd, 1, changed.empty() ? -1 : SettleTime);
+		if (ready < 0)
+			throw std::runtime_error("Waiting for file changes failed");
+
+		if (ready == 0)
+			break;
+
+		ssize_t length = read(m_fd, buffer, sizeof(buffer));
+		if (length <= 0)
+			throw std::runtime_error("Reading file change events failed");
+
+		for (ssize_t offset = 0; offset < length;) {
+			auto event = reinterpret_cast<const struct inotify_event *>(buffer + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+
+			auto directory = m_directories.find(event->wd);
+			if (directory == m_directories.end() || event->len == 0)
+				continue;
+
+			auto file = m_files.find(directory->second + "/" + event->name);
+			if (file != m_files.end() && std::find(changed.begin(), changed.end(), file->second) == changed.end())
+				changed.push_back(file->second);
+		}
+	}
+#endif
+
+	return changed;
+}
@@ -0,0 +1,46 @@
+#ifndef FILE_WATCHER__H
+#define FILE_WATCHER__H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Waits for changes to a set of files. Directories containing the files
+ * are watched rather than the files themselves, so that files replaced by
+ * renaming a new version over them (as many editors and linkers do) keep
+ * being noticed. Only supported on Linux, where inotify is used.
+ */
+class FileWatcher {
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher &other) = delete;
+	FileWatcher &operator =(const FileWatcher &other) = delete;
+
+	/*
+	 * Replaces the set of watched files. Directories that stay watched
+	 * keep their watches, so changes that happened before the call and
+	 * concern files that are still watched are reported by wait().
+	 */
+	void setFiles(const std::vector<std::string> &files);
+
+	/*
+	 * Blocks until at least one watched file is written, created, replaced
+	 * or removed, and returns the names of the changed files, as given to
+	 * setFiles. Changes following each other within SettleTime are
+	 * reported together, so that a file being written in several steps
+	 * is only reported once.
+	 */
+	std::vector<std::string> wait();
+
+private:
+	static const int SettleTime = 200; // Milliseconds
+
+	int m_fd;
+	std::unordered_map<int, std::string> m_directories; // By watch descriptor
+	std::unordered_map<std::string, std::string> m_files; // Given names, by directory and base name
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include "FrameCompressor.h"
+#include "BlockCache.h"
+#include "WorkerPool.h"
+#include "lz4.h"
+#include "xxhash.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#include <stdint.h>
+#include <string.h>
+
+FrameCompressor::FrameCompressor(const LZ4F_preferences_t &preferences, WorkerPool &pool) :
+	m_preferences(preferences), m_blockPreferences(preferences), m_pool(pool), m_contexts(pool.jobs(), nullptr),
+	m_blockCache(nullptr), m_skipIncompressible(false), m_checksumState(XXH32_createState()), m_totalBlocks(0), m_cachedBlocks(0),
+	m_storedBlocks(0) {
+
+	if (!m_checksumState)
+		throw std::bad_alloc();
+
+	if (m_preferences.frameInfo.blockMode != LZ4F_blockIndependent)
+		throw std::logic_error("FrameCompressor requires independent blocks");
+
+	if (m_preferences.frameInfo.blockSizeID == LZ4F_default)
+		m_preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+
+	m_blockSize = blockSize(m_preferences.frameInfo.blockSizeID);
+
+	/*
+	 * Workers run each block through a frame of their own, of which only
+	 * the block itself is kept. Content size and checksum belong to the
+	 * outer frame, so they are left out of the per-block frames.
+	 */
+	m_blockPreferences = m_preferences;
+	m_blockPreferences.autoFlush = 1;
+	m_blockPreferences.frameInfo.contentSize = 0;
+	m_blockPreferences.frameInfo.contentChecksumFlag = LZ4F_noContentChecksum;
+
+	/*
+	 * Everything that determines the bytes of a compressed block, other
+	 * than the block data itself.
+	 */
+	int32_t blockSettings[] = {
+		1, // Format version of cached blocks
+		m_blockPreferences.compressionLevel,
+		static_cast<int32_t>(m_blockPreferences.favorDecSpeed),
+		static_cast<int32_t>(m_blockPreferences.frameInfo.blockChecksumFlag),
+		LZ4_VERSION_NUMBER
+	};
+	m_settingsHash = XXH64(blockSettings, sizeof(blockSettings), 0);
+}
+
+FrameCompressor::~FrameCompressor() {
+	XXH32_freeState(m_checksumState);
+
+	for (auto context : m_contexts) {
+		if (context)
+			LZ4F_freeCompressionContext(context);
+	}
+}
+
+size_t FrameCompressor::blockSize(LZ4F_blockSizeID_t blockSizeID) {
+	switch (blockSizeID) {
+	case LZ4F_default:
+	case LZ4F_max64KB:
+		return 64 * 1024;
+
+	case LZ4F_max256KB:
+		return 256 * 1024;
+
+	case LZ4F_max1MB:
+		return 1024 * 1024;
+
+	case LZ4F_max4MB:
+		return 4 * 1024 * 1024;
+
+	default:
+		throw std::runtime_error("Invalid LZ4 block size");
+	}
+}
+
+LZ4F_blockSizeID_t FrameCompressor::blockSizeID(size_t blockSize) {
+	switch (blockSize) {
+	case 64 * 1024:
+		return LZ4F_max64KB;
+
+	case 256 * 1024:
+		return LZ4F_max256KB;
+
+	case 1024 * 1024:
+		return LZ4F_max1MB;
+
+	case 4 * 1024 * 1024:
+		return LZ4F_max4MB;
+
+	default:
+		throw std::runtime_error("Invalid LZ4 block size");
+	}
+}
+
+void FrameCompressor::setBlockCache(BlockCache *cache) {
+	m_blockCache = cache;
+}
+
+void FrameCompressor::setSkipIncompressible(bool skip) {
+	m_skipIncompressible = skip;
+}
+
+std::vector<FrameCompressor::BlockRange> FrameCompressor::blockRanges(size_t size, const std::vector<size_t> &boundaries) const {
+	std::vector<BlockRange> ranges;
+	size_t offset = 0;
+	auto boundary = boundaries.begin();
+
+	while (offset < size) {
+		while (boundary != boundaries.end() && *boundary <= offset) {
+			++boundary;
+		}
+
+		size_t limit = std::min(size, offset + m_blockSize);
+		if (boundary != boundaries.end())
+			limit = std::min(limit, *boundary);
+
+		ranges.push_back(BlockRange{ offset, limit - offset, false });
+		offset = limit;
+	}
+
+	return ranges;
+}
+
+std::vector<unsigned char> FrameCompressor::compress(const unsigned char *data, size_t size, const std::vector<size_t> &boundaries) {
+	return compress(data, blockRanges(size, boundaries));
+}
+
+std::vector<unsigned char> FrameCompressor::compress(const unsigned char *data, const std::vector<BlockRange> &ranges) {
+	auto output = begin();
+	auto blocks = update(data, ranges);
+	auto trailer = end();
+
+	output.reserve(output.size() + blocks.size() + trailer.size());
+	output.insert(output.end(), blocks.begin(), blocks.end());
+	output.insert(output.end(), trailer.begin(), trailer.end());
+
+	return output;
+}
+
+std::vector<unsigned char> FrameCompressor::begin() {
+	std::vector<unsigned char> header(LZ4F_HEADER_SIZE_MAX);
+
+	LZ4F_cctx *context;
+	if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION)))
+		throw std::runtime_error("LZ4F_createCompressionContext failed");
+
+	auto chunk = LZ4F_compressBegin(context, header.data(), header.size(), &m_preferences);
+	LZ4F_freeCompressionContext(context);
+
+	if (LZ4F_isError(chunk))
+		throw std::runtime_error(LZ4F_getErrorName(chunk));
+
+	header.resize(chunk);
+
+	XXH32_reset(m_checksumState, 0);
+
+	return header;
+}
+
+std::vector<unsigned char> FrameCompressor::update(const unsigned char *data, const std::vector<BlockRange> &ranges) {
+	std::vector<unsigned char> output;
+
+	update(data, ranges, [&output](const unsigned char *block, size_t size) {
+		output.insert(output.end(), block, block + size);
+	});
+
+	return output;
+}
+
+void FrameCompressor::update(const unsigned char *data, const std::vector<BlockRange> &ranges, const BlockSink &sink) {
+	std::vector<std::vector<unsigned char>> blocks(ranges.size());
+	std::atomic<size_t> cachedBlocks(0);
+	std::atomic<size_t> storedBlocks(0);
+
+	m_pool.run(ranges.size(), [&](size_t block, unsigned int worker) {
+		const auto &range = ranges[block];
+
+		if (range.stored || (m_skipIncompressible && isIncompressible(data + range.offset, range.size))) {
+			blocks[block] = storedBlock(data + range.offset, range.size);
+			storedBlocks++;
+		}
+		else if (m_blockCache) {
+			auto key = m_blockCache->key(data + range.offset, range.size, m_settingsHash);
+
+			if (m_blockCache->fetch(key, data + range.offset, range.size,
+				m_blockPreferences.frameInfo.blockChecksumFlag == LZ4F_blockChecksumEnabled, blocks[block])) {
+
+				cachedBlocks++;
+				return;
+			}
+
+			blocks[block] = compressBlock(data + range.offset, range.size, worker);
+			m_blockCache->store(key, blocks[block]);
+		}
+		else {
+			blocks[block] = compressBlock(data + range.offset, range.size, worker);
+		}
+	});
+
+	m_totalBlocks += blocks.size();
+	m_cachedBlocks += cachedBlocks;
+	m_storedBlocks += storedBlocks;
+
+	if (m_preferences.frameInfo.contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+		for (const auto &range : ranges) {
+			XXH32_update(m_checksumState, data + range.offset, range.size);
+		}
+	}
+
+	for (auto &block : blocks) {
+		sink(block.data(), block.size());
+		std::vector<unsigned char>().swap(block);
+	}
+}
+
+std::vector<unsigned char> FrameCompressor::end() {
+	std::vector<unsigned char> trailer(4, 0); // End mark
+
+	if (m_preferences.frameInfo.contentChecksumFlag == LZ4F_contentChecksumEnabled) {
+		uint32_t checksum = XXH32_digest(m_checksumState);
+		trailer.push_back(static_cast<unsigned char>(checksum));
+		trailer.push_back(static_cast<unsigned char>(checksum >> 8));
+		trailer.push_back(static_cast<unsigned char>(checksum >> 16));
+		trailer.push_back(static_cast<unsigned char>(checksum >> 24));
+	}
+
+	return trailer;
+}
+
+std::vector<unsigned char> FrameCompressor::storedBlock(const unsigned char *data, size_t size) const {
+	std::vector<unsigned char> block(4 + size);
+
+	uint32_t header = static_cast<uint32_t>(size) | 0x80000000U; // Uncompressed block flag
+	block[0] = static_cast<unsigned char>(header);
+	block[1] = static_cast<unsigned char>(header >> 8);
+	block[2] = static_cast<unsigned char>(header >> 16);
+	block[3] = static_cast<unsigned char>(header >> 24);
+	memcpy(block.data() + 4, data, size);
+
+	if (m_blockPreferences.frameInfo.blockChecksumFlag == LZ4F_blockChecksumEnabled) {
+		uint32_t checksum = XXH32(data, size, 0);
+		block.push_back(static_cast<unsigned char>(checksum));
+		block.push_back(static_cast<unsigned char>(checksum >> 8));
+		block.push_back(static_cast<unsigned char>(checksum >> 16));
+		block.push_back(static_cast<unsigned char>(checksum >> 24));
+	}
+
+	return block;
+}
+
+bool FrameCompressor::isIncompressible(const unsigned char *data, size_t size) {
+	if (size < 4096)
+		return false;
+
+	std::vector<char> trial(LZ4_compressBound(static_cast<int>(size)));
+	int compressed = LZ4_compress_default(reinterpret_cast<const char *>(data), trial.data(), static_cast<int>(size), static_cast<int>(trial.size()));
+
+	return compressed <= 0 || static_cast<size_t>(compressed) > size - size / 32;
+}
+
+std::vector<unsigned char> FrameCompressor::compressBlock(const unsigned char *data, size_t size, unsigned int worker) {
+	auto &context = m_contexts[worker];
+	if (!context) {
+		if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION))) {
+			context = nullptr;
+			throw std::runtime_error("LZ4F_createCompressionContext failed");
+		}
+	}
+
+	unsigned char header[LZ4F_HEADER_SIZE_MAX];
+	auto chunk = LZ4F_compressBegin(context, header, sizeof(header), &m_blockPreferences);
+	if (LZ4F_isError(chunk))
+		throw std::runtime_error(LZ4F_getErrorName(chunk));
+
+	LZ4F_compressOptions_t opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.stableSrc = 1;
+
+	std::vector<unsigned char> block(LZ4F_compressBound(size, &m_blockPreferences));
+	chunk = LZ4F_compressUpdate(context, block.data(), block.size(), data, size, &opts);
+	if (LZ4F_isError(chunk))
+		throw std::runtime_error(LZ4F_getErrorName(chunk));
+
+	block.resize(chunk);
+
+	return block;
+}
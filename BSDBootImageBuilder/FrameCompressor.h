@@ -0,0 +1,109 @@
+#ifndef FRAME_COMPRESSOR__H
+#define FRAME_COMPRESSOR__H
+
+#include <functional>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lz4frame.h"
+#include "xxhash.h"
+
+class BlockCache;
+class WorkerPool;
+
+/*
+ * Produces an LZ4 frame with independent blocks. Since no block refers to
+ * the data of any other block, blocks are compressed concurrently on a
+ * worker pool, each with its own LZ4F context, and then concatenated in
+ * order. Without extra boundaries, the result is identical to what a single
+ * LZ4F_compressUpdate call over the whole input would produce with the same
+ * preferences.
+ */
+class FrameCompressor {
+public:
+	FrameCompressor(const LZ4F_preferences_t &preferences, WorkerPool &pool);
+	~FrameCompressor();
+
+	FrameCompressor(const FrameCompressor &other) = delete;
+	FrameCompressor &operator =(const FrameCompressor &other) = delete;
+
+	struct BlockRange {
+		size_t offset;
+		size_t size;
+		bool stored; // Emit the block uncompressed
+	};
+
+	typedef std::function<void(const unsigned char *block, size_t size)> BlockSink;
+
+	/*
+	 * Splits size bytes of input into frame blocks. Block boundaries are
+	 * placed every frame block size bytes, and additionally at every offset
+	 * listed in boundaries (which must be sorted), so that the contents of
+	 * the blocks following a boundary do not depend on the data preceding it.
+	 */
+	std::vector<BlockRange> blockRanges(size_t size, const std::vector<size_t> &boundaries) const;
+
+	/*
+	 * Compresses size bytes at data into a complete frame.
+	 */
+	std::vector<unsigned char> compress(const unsigned char *data, size_t size, const std::vector<size_t> &boundaries = std::vector<size_t>());
+	std::vector<unsigned char> compress(const unsigned char *data, const std::vector<BlockRange> &ranges);
+
+	/*
+	 * Incremental interface: begin() returns the frame header, every call
+	 * to update() returns the compressed blocks for the given ranges of
+	 * data (or passes them to the sink in order, releasing each block once
+	 * it has been consumed), and end() returns the end mark and content
+	 * checksum. The ranges passed to successive update() calls must follow
+	 * each other in the input.
+	 */
+	std::vector<unsigned char> begin();
+	std::vector<unsigned char> update(const unsigned char *data, const std::vector<BlockRange> &ranges);
+	void update(const unsigned char *data, const std::vector<BlockRange> &ranges, const BlockSink &sink);
+	std::vector<unsigned char> end();
+
+	void setBlockCache(BlockCache *cache);
+
+	/*
+	 * When enabled, every block is first trial-compressed with the fast
+	 * LZ4 compressor, and blocks that it cannot shrink by at least 1/32
+	 * are stored uncompressed without running the configured compressor.
+	 */
+	void setSkipIncompressible(bool skip);
+
+	inline size_t totalBlocks() const {
+		return m_totalBlocks;
+	}
+
+	inline size_t cachedBlocks() const {
+		return m_cachedBlocks;
+	}
+
+	inline size_t storedBlocks() const {
+		return m_storedBlocks;
+	}
+
+	static size_t blockSize(LZ4F_blockSizeID_t blockSizeID);
+	static LZ4F_blockSizeID_t blockSizeID(size_t blockSize);
+
+private:
+	std::vector<unsigned char> compressBlock(const unsigned char *data, size_t size, unsigned int worker);
+	std::vector<unsigned char> storedBlock(const unsigned char *data, size_t size) const;
+	static bool isIncompressible(const unsigned char *data, size_t size);
+
+	LZ4F_preferences_t m_preferences;
+	LZ4F_preferences_t m_blockPreferences;
+	WorkerPool &m_pool;
+	size_t m_blockSize;
+	std::vector<LZ4F_cctx *> m_contexts;
+	BlockCache *m_blockCache;
+	uint64_t m_settingsHash;
+	bool m_skipIncompressible;
+	XXH32_state_t *m_checksumState;
+	size_t m_totalBlocks;
+	size_t m_cachedBlocks;
+	size_t m_storedBlocks;
+};
+
+#endif
@@ -28,4 +28,31 @@ enum : uint32_t {
 	KERNEL_VADDR         = 0xC0000000
 };
 
+/*
+ * Module metadata, as found in the set_modmetadata_set linker set of the
+ * kernel and of every module (sys/module.h).
+ */
+enum : uint32_t {
+	MDT_DEPEND           = 1,
+	MDT_MODULE           = 2,
+	MDT_VERSION          = 3
+};
+
+struct mod_metadata32 {
+	int32_t md_version;
+	int32_t md_type;
+	uint32_t md_data;
+	uint32_t md_cval;
+};
+
+struct mod_depend32 {
+	int32_t md_ver_minimum;
+	int32_t md_ver_preferred;
+	int32_t md_ver_maximum;
+};
+
+struct mod_version32 {
+	int32_t mv_version;
+};
+
 #endif
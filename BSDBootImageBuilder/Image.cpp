@@ -1,19 +1,35 @@
 #include "Image.h"
+#include "BlockCache.h"
+#include "BootCostModel.h"
 #include "Blueprint.h"
+#include "BuildOptions.h"
+#include "ExtentLoader.h"
+#include "FileCopy.h"
+#include "FileProvider.h"
+#include "FrameCompressor.h"
 #include "FreeBSDTypes.h"
+#include "InPlaceVerifier.h"
+#include "InputFile.h"
+#include "Log.h"
+#include "ModuleDependencies.h"
+#include "Prelinker.h"
+#include "SymbolTable.h"
+#include "WorkerPool.h"
+#include "ZeroScan.h"
 #include "elf32.h"
 #include "lz4frame.h"
-#include "lz4hc.h"
 
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
 
-struct LZ4FDeleter {
-	inline void operator()(LZ4F_cctx *context) const {
-		LZ4F_freeCompressionContext(context);
-	}
-};
+#include <inttypes.h>
+#include <string.h>
 
 static const uint8_t ElfIdentification[EI_NIDENT] = {
 	ELFMAG0,
@@ -25,7 +41,422 @@ static const uint8_t ElfIdentification[EI_NIDENT] = {
 	EV_CURRENT
 };
 
-Image::Image() {
+struct Image::CompressionSession {
+	explicit CompressionSession(const Image &image);
+
+	void finish();
+
+	/*
+	 * Compresses the given ranges of data, which starts at offset bytes
+	 * into the image, and records the resulting blocks.
+	 */
+	void update(const unsigned char *data, size_t offset, const std::vector<FrameCompressor::BlockRange> &ranges,
+		const FrameCompressor::BlockSink &sink);
+
+	std::vector<size_t> frameBoundaries(const ImageFrame &frame) const;
+	std::vector<FrameCompressor::BlockRange> frameRanges(const ImageFrame &frame) const;
+
+	static LZ4F_preferences_t preferences(const CompressionSettings &settings);
+
+	const CompressionSettings &settings;
+	WorkerPool &pool;
+	std::unique_ptr<BlockCache> ownBlockCache;
+	BlockCache *blockCache;
+	FrameCompressor compressor;
+	std::vector<size_t> boundaries;
+	std::vector<std::pair<size_t, size_t>> storedRanges; // Of NOCOMPRESS regions
+	std::vector<CompressedBlock> blocks;
+};
+
+Image::CompressionSession::CompressionSession(const Image &image) :
+	settings(image.m_compression), pool(*image.m_pool), blockCache(image.m_blockCache), compressor(preferences(image.m_compression), pool) {
+
+	if (!blockCache && !image.m_options.blockCacheDirectory.empty()) {
+		ownBlockCache.reset(new BlockCache(image.m_options.blockCacheDirectory));
+		blockCache = ownBlockCache.get();
+	}
+
+	compressor.setBlockCache(blockCache);
+
+	if (settings.moduleAlignedBlocks)
+		boundaries = image.m_layout.regionBoundaries();
+
+	compressor.setSkipIncompressible(settings.skipIncompressible);
+
+	/*
+	 * NOCOMPRESS regions get block boundaries of their own, so that their
+	 * blocks can be stored without affecting neighbouring data.
+	 */
+	for (const auto &region : image.m_layout.regions) {
+		if (region.noCompress && region.size != 0) {
+			size_t start = region.base - image.m_imageBase;
+			storedRanges.emplace_back(start, start + region.size);
+			boundaries.push_back(start);
+			boundaries.push_back(start + region.size);
+		}
+	}
+
+	std::sort(boundaries.begin(), boundaries.end());
+	boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+	logPrintf("Compressing image using %u threads: level %d, block size %u KiB%s%s%s%s\n",
+		pool.jobs(), settings.level, settings.blockSize / 1024,
+		settings.favorDecompressionSpeed ? ", favoring decompression speed" : "",
+		settings.contentChecksum ? ", content checksum" : "",
+		settings.blockChecksum ? ", block checksums" : "",
+		settings.skipIncompressible ? ", skipping incompressible blocks" : "");
+}
+
+void Image::CompressionSession::finish() {
+	if (compressor.storedBlocks() != 0) {
+		logPrintf("%zu of %zu blocks stored uncompressed\n", compressor.storedBlocks(), compressor.totalBlocks());
+	}
+
+	if (blockCache) {
+		logPrintf("Block cache: %zu of %zu blocks reused\n", compressor.cachedBlocks(), compressor.totalBlocks());
+	}
+}
+
+void Image::CompressionSession::update(const unsigned char *data, size_t offset, const std::vector<FrameCompressor::BlockRange> &ranges,
+	const FrameCompressor::BlockSink &sink) {
+
+	auto range = ranges.begin();
+
+	compressor.update(data, ranges, [&](const unsigned char *block, size_t size) {
+		uint32_t header = block[0] | (block[1] << 8) | (block[2] << 16) | (static_cast<uint32_t>(block[3]) << 24);
+		blocks.push_back(CompressedBlock{ offset + range->offset, range->size, size, (header & 0x80000000U) != 0 });
+		++range;
+
+		sink(block, size);
+	});
+}
+
+/*
+ * Output stream buffer appending to a byte vector. Unlike a string stream,
+ * it can be positioned past the data written so far, as writeElf does on a
+ * fresh stream; the gap is filled with zeros once data is written past it.
+ */
+class OutputBuffer : public std::streambuf {
+public:
+	explicit OutputBuffer(std::vector<uint8_t> &output) : m_output(output), m_position(0) {
+
+	}
+
+protected:
+	virtual int_type overflow(int_type ch) override {
+		if (traits_type::eq_int_type(ch, traits_type::eof()))
+			return traits_type::not_eof(ch);
+
+		char data = traits_type::to_char_type(ch);
+		xsputn(&data, 1);
+
+		return ch;
+	}
+
+	virtual std::streamsize xsputn(const char *data, std::streamsize size) override {
+		size_t end = m_position + static_cast<size_t>(size);
+		if (end > m_output.size())
+			m_output.resize(end);
+
+		memcpy(m_output.data() + m_position, data, static_cast<size_t>(size));
+		m_position = end;
+
+		return size;
+	}
+
+	virtual pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override {
+		off_type base;
+
+		if (!(which & std::ios_base::out))
+			return pos_type(off_type(-1));
+
+		if (direction == std::ios_base::beg)
+			base = 0;
+		else if (direction == std::ios_base::cur)
+			base = static_cast<off_type>(m_position);
+		else
+			base = static_cast<off_type>(m_output.size());
+
+		if (base + offset < 0)
+			return pos_type(off_type(-1));
+
+		m_position = static_cast<size_t>(base + offset);
+
+		return pos_type(base + offset);
+	}
+
+	virtual pos_type seekpos(pos_type position, std::ios_base::openmode which) override {
+		return seekoff(off_type(position), std::ios_base::beg, which);
+	}
+
+private:
+	std::vector<uint8_t> &m_output;
+	size_t m_position;
+};
+
+/*
+ * Loads an image buffer from a layout on a thread of its own, in chunks and
+ * in increasing order, so that compression of the loaded part of the image
+ * can proceed while the rest is still being read. Since the buffer covers
+ * the whole image, loading never has to wait for compression, and the
+ * progress of loading is fully described by how far it has got.
+ */
+class LoadPipeline {
+public:
+	LoadPipeline(ExtentLoader &loader, uint8_t *data, size_t size, size_t chunkSize) :
+		m_loader(loader), m_data(data), m_size(size), m_chunkSize(chunkSize), m_loaded(0), m_stop(false) {
+
+		m_thread = std::thread(&LoadPipeline::run, this);
+	}
+
+	~LoadPipeline() {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+
+		m_thread.join();
+	}
+
+	LoadPipeline(const LoadPipeline &other) = delete;
+	LoadPipeline &operator =(const LoadPipeline &other) = delete;
+
+	/*
+	 * Blocks until the image has been loaded at least up to end, and
+	 * returns how far it has been loaded. Rethrows any loading error.
+	 */
+	size_t wait(size_t end) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_progress.wait(lock, [this, end]() {
+			return m_loaded >= end || m_error;
+		});
+
+		if (m_error)
+			std::rethrow_exception(m_error);
+
+		return m_loaded;
+	}
+
+private:
+	void run() {
+		try {
+			for (size_t offset = 0; offset < m_size; offset += m_chunkSize) {
+				size_t size = std::min(m_chunkSize, m_size - offset);
+
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_stop)
+						return;
+				}
+
+				m_loader.load(offset, m_data + offset, size);
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_loaded = offset + size;
+				m_progress.notify_all();
+			}
+		}
+		catch (...) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_error = std::current_exception();
+			m_progress.notify_all();
+		}
+	}
+
+	ExtentLoader &m_loader;
+	uint8_t *m_data;
+	size_t m_size;
+	size_t m_chunkSize;
+	std::mutex m_mutex;
+	std::condition_variable m_progress;
+	size_t m_loaded;
+	bool m_stop;
+	std::exception_ptr m_error;
+	std::thread m_thread;
+};
+
+/*
+ * Writes an uncompressed image to the output as one or more segments. With
+ * a non-zero minimum gap, zero pages are not written right away; a zero run
+ * of at least minimumGap bytes that ends at a page boundary closes the
+ * current segment, which then covers the run with its memory size only.
+ * Trailing zeros of every segment are always left to the memory size.
+ */
+struct Image::SegmentWriter {
+	SegmentWriter(std::ostream &stream, size_t minimumGap, FileProvider &files, std::vector<DeferredCopy> *deferred);
+
+	void write(size_t offset, const uint8_t *data, size_t size);
+	void writeDirect(const LayoutExtent &extent);
+	std::vector<ImageSegment> finish(size_t imageSize);
+
+	void beginData(size_t offset);
+	void writeZeros(size_t size);
+
+	std::ostream &stream;
+	size_t minimumGap;
+	FileProvider &files;
+	std::vector<DeferredCopy> *deferred;
+	std::vector<ImageSegment> segments;
+	bool open;
+	size_t segmentStart;
+	uint64_t segmentFileOffset;
+	size_t dataEnd;
+	uint64_t filePosition;
+};
+
+Image::SegmentWriter::SegmentWriter(std::ostream &stream, size_t minimumGap, FileProvider &files, std::vector<DeferredCopy> *deferred) :
+	stream(stream), minimumGap(minimumGap), files(files), deferred(deferred), open(false), segmentStart(0), segmentFileOffset(0),
+	dataEnd(0), filePosition(ImageDataOffset) {
+
+}
+
+void Image::SegmentWriter::write(size_t offset, const uint8_t *data, size_t size) {
+	if (minimumGap == 0) {
+		beginData(offset);
+		stream.write(reinterpret_cast<const char *>(data), size);
+		dataEnd = offset + size;
+		filePosition += size;
+		return;
+	}
+
+	/*
+	 * Pages are those of the image, not of the data, which may start in
+	 * the middle of a page (e.g. after a direct extent), so that segments
+	 * only ever start at page boundaries.
+	 */
+	for (size_t page = 0; page < size; ) {
+		size_t pageSize = std::min<size_t>(4096 - (offset + page) % 4096, size - page);
+
+		if (!isZero(data + page, pageSize)) {
+			size_t length = trimZeros(data + page, pageSize);
+
+			beginData(offset + page);
+			stream.write(reinterpret_cast<const char *>(data + page), length);
+			dataEnd = offset + page + length;
+			filePosition += length;
+		}
+
+		page += pageSize;
+	}
+}
+
+void Image::SegmentWriter::writeDirect(const LayoutExtent &extent) {
+	beginData(extent.offset);
+
+	/*
+	 * Direct extents are either left as a hole, to be filled in once the
+	 * stream is closed, or written from the input file when the output
+	 * is not a file.
+	 */
+
+	if (deferred) {
+		stream.seekp(extent.size, std::ios::cur);
+		deferred->push_back(DeferredCopy{ &extent, filePosition });
+	}
+	else {
+		auto file = files.open(extent.fileName);
+		stream.write(reinterpret_cast<const char *>(file->view(extent.fileOffset, extent.size)), extent.size);
+	}
+
+	dataEnd = extent.offset + extent.size;
+	filePosition += extent.size;
+}
+
+void Image::SegmentWriter::beginData(size_t offset) {
+	static const size_t MaximumSegments = (ImageDataOffset - sizeof(Elf32_Ehdr)) / sizeof(Elf32_Phdr) - 1; // One is taken by the kickstart
+
+	if (!open) {
+		open = true;
+		segmentStart = minimumGap == 0 ? 0 : offset;
+		segmentFileOffset = filePosition;
+		dataEnd = segmentStart;
+	}
+	else if (minimumGap != 0 && offset - dataEnd >= minimumGap && segments.size() + 1 < MaximumSegments) {
+		segments.push_back(ImageSegment{ segmentStart, segmentFileOffset, dataEnd - segmentStart, offset - segmentStart });
+
+		filePosition = (filePosition + 4095) & ~static_cast<uint64_t>(4095);
+		stream.seekp(filePosition);
+
+		segmentStart = offset;
+		segmentFileOffset = filePosition;
+		dataEnd = offset;
+	}
+
+	writeZeros(offset - dataEnd);
+	dataEnd = offset;
+}
+
+void Image::SegmentWriter::writeZeros(size_t size) {
+	static const uint8_t zeros[4096] = { 0 };
+
+	filePosition += size;
+
+	while (size > 0) {
+		size_t chunk = std::min(size, sizeof(zeros));
+		stream.write(reinterpret_cast<const char *>(zeros), chunk);
+		size -= chunk;
+	}
+}
+
+std::vector<Image::ImageSegment> Image::SegmentWriter::finish(size_t imageSize) {
+	if (!open) {
+		open = true;
+		segmentFileOffset = filePosition;
+	}
+
+	if (minimumGap == 0) {
+		writeZeros(imageSize - dataEnd);
+		dataEnd = imageSize;
+	}
+
+	segments.push_back(ImageSegment{ segmentStart, segmentFileOffset, dataEnd - segmentStart, imageSize - segmentStart });
+
+	return std::move(segments);
+}
+
+std::vector<size_t> Image::CompressionSession::frameBoundaries(const ImageFrame &frame) const {
+	std::vector<size_t> result;
+
+	for (auto boundary : boundaries) {
+		if (boundary > frame.offset && boundary < frame.offset + frame.size)
+			result.push_back(boundary - frame.offset);
+	}
+
+	return result;
+}
+
+std::vector<FrameCompressor::BlockRange> Image::CompressionSession::frameRanges(const ImageFrame &frame) const {
+	auto ranges = compressor.blockRanges(frame.size, frameBoundaries(frame));
+
+	for (auto &range : ranges) {
+		size_t start = frame.offset + range.offset;
+
+		for (const auto &stored : storedRanges) {
+			if (start >= stored.first && start + range.size <= stored.second) {
+				range.stored = true;
+				break;
+			}
+		}
+	}
+
+	return ranges;
+}
+
+LZ4F_preferences_t Image::CompressionSession::preferences(const CompressionSettings &settings) {
+	LZ4F_preferences_t prefs;
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs.frameInfo.blockSizeID = FrameCompressor::blockSizeID(settings.blockSize);
+	prefs.frameInfo.contentChecksumFlag = settings.contentChecksum ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
+	prefs.frameInfo.blockChecksumFlag = settings.blockChecksum ? LZ4F_blockChecksumEnabled : LZ4F_noBlockChecksum;
+	prefs.compressionLevel = settings.level;
+	prefs.favorDecSpeed = settings.favorDecompressionSpeed;
+
+	return prefs;
+}
+
+Image::Image() : m_imageDisplacement(0), m_compress(false), m_sparseMinimumGap(0), m_symbolFilter(SymbolFilter::All), m_stripDebug(false), m_pack(false), m_paddingSaved(0), m_files(&FileProvider::disk()), m_blockCache(nullptr), m_frameTable(0), m_framesBase(0) {
 
 }
 
@@ -33,34 +464,238 @@ Image::~Image() {
 
 }
 
-void Image::writeSymbolSection(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, std::istream &fileStream) {
+void Image::setFileProvider(FileProvider &files) {
+	m_files = &files;
+}
+
+void Image::setBlockCache(BlockCache *cache) {
+	m_blockCache = cache;
+}
+
+void Image::writeSymbolSection(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, const InputFile &file) {
 	uint32_t size = section.sh_size;
-	
-	if (m_image.size() < esym + sizeof(size) + size) {
-		m_image.resize(esym + sizeof(size) + size - m_imageBase);
-	}
 
-	memcpy(m_image.data() + esym - m_imageBase, &size, sizeof(size));
+	file.view(section.sh_offset, size);
 
-	fileStream.seekg(section.sh_offset);
-	fileStream.read(reinterpret_cast<char *>(m_image.data()) + esym + sizeof(size) - m_imageBase, section.sh_size);
+	m_layout.addDataExtent(esym, &size, sizeof(size));
+	m_layout.addFileExtent(esym + sizeof(size), file.fileName(), section.sh_offset, size);
 
 	esym = (esym + sizeof(size) + size + 3) & ~3;
 
 	if (section.sh_type == SHT_SYMTAB) {
-		writeSymbolSection(sections[section.sh_link], esym, sections, fileStream);
+		if (section.sh_link >= sections.size())
+			throw std::runtime_error("Bad symbol table string table link");
+
+		writeSymbolSection(sections[section.sh_link], esym, sections, file);
 	}
 
 }
 
-void Image::build(Blueprint &blueprint) {
+void Image::prelinkModule(const Module &mod, const InputFile &file, const std::vector<Elf32_Phdr> &segments,
+	const std::vector<Elf32_Shdr> &sections, const std::vector<char> &sectionNames, uint32_t virtualBase) {
+	if (m_prelinker->kernelSymbols() == 0)
+		throw std::runtime_error("PRELINK requires the kernel, with a symbol table, to precede all modules");
+
+	std::vector<Prelinker::Patch> patches;
+	std::string reason;
+
+	if (!m_prelinker->prelink(file, segments, sections, sectionNames, virtualBase, patches, reason)) {
+		logPrintf("elf module %s is not prelinked: %s\n", mod.name.c_str(), reason.c_str());
+		return;
+	}
+
+	std::sort(patches.begin(), patches.end(), [](const Prelinker::Patch &a, const Prelinker::Patch &b) {
+		return a.address < b.address;
+	});
+
+	/*
+	 * Patched words override the file contents; runs of adjacent words,
+	 * such as the GOT, become a single extent.
+	 */
+	std::vector<uint32_t> run;
+	uint32_t runStart = 0;
+
+	for (size_t index = 0; index <= patches.size(); index++) {
+		if (index == patches.size() || (!run.empty() && patches[index].address != runStart + run.size() * sizeof(uint32_t))) {
+			m_layout.addDataExtent(runStart + virtualBase + m_kernelDelta, run.data(), static_cast<uint32_t>(run.size() * sizeof(uint32_t)));
+			run.clear();
+		}
+
+		if (index == patches.size())
+			break;
+
+		if (run.empty())
+			runStart = patches[index].address;
+
+		run.push_back(patches[index].value);
+	}
+
+	logPrintf("elf module %s prelinked: %zu words patched\n", mod.name.c_str(), patches.size());
+}
+
+static bool isDebugSection(const char *name) {
+	static const char *const prefixes[] = {
+		".debug",
+		".zdebug",
+		".stab",
+		".line",
+		".comment",
+		".gnu_debuglink",
+		".gnu_debugaltlink"
+	};
+
+	for (auto prefix : prefixes) {
+		if (strncmp(name, prefix, strlen(prefix)) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> Image::stripDebugSections(std::vector<Elf32_Shdr> &sections, const std::vector<Elf32_Phdr> &segments,
+	const std::vector<char> &names) {
+
+	std::vector<std::pair<uint64_t, uint64_t>> stripped;
+	uint64_t strippedBytes = 0;
+
+	for (auto &section : sections) {
+		if ((section.sh_flags & SHF_ALLOC) || section.sh_type == SHT_NOBITS || section.sh_size == 0 ||
+			section.sh_name >= names.size() || !isDebugSection(names.data() + section.sh_name))
+			continue;
+
+		uint64_t start = section.sh_offset;
+		uint64_t end = start + section.sh_size;
+		bool loaded = false;
+
+		for (const auto &segment : segments) {
+			if (segment.p_type == PT_LOAD && start < static_cast<uint64_t>(segment.p_offset) + segment.p_filesz && end > segment.p_offset) {
+				loaded = true;
+				break;
+			}
+		}
+
+		if (!loaded)
+			continue;
+
+		stripped.emplace_back(start, end);
+		strippedBytes += section.sh_size;
+
+		/*
+		 * The section stays in the table, so that section indices do not
+		 * change, but no longer has any contents.
+		 */
+		section.sh_type = SHT_NULL;
+		section.sh_addr = 0;
+		section.sh_offset = 0;
+		section.sh_size = 0;
+	}
+
+	std::sort(stripped.begin(), stripped.end());
+
+	if (strippedBytes != 0) {
+		logPrintf("Stripped %" PRIu64 " bytes of debug sections from loaded segments\n", strippedBytes);
+	}
+
+	return stripped;
+}
+
+void Image::writeCompactSymbolTable(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, const InputFile &file) {
+	if (section.sh_link >= sections.size())
+		throw std::runtime_error("Bad symbol table string table link");
+
+	std::vector<uint8_t> symbols;
+	std::vector<uint8_t> strings;
+	compactSymbolTable(file, section, sections[section.sh_link], m_symbolFilter, symbols, strings);
+
+	logPrintf("Symbol table compacted from %u to %zu bytes, string table from %u to %zu bytes\n",
+		section.sh_size, symbols.size(), sections[section.sh_link].sh_size, strings.size());
+
+	for (const auto &table : { &symbols, &strings }) {
+		uint32_t size = static_cast<uint32_t>(table->size());
+
+		m_layout.addDataExtent(esym, &size, sizeof(size));
+		m_layout.addDataExtent(esym + sizeof(size), table->data(), size);
+
+		esym = (esym + sizeof(size) + size + 3) & ~3;
+	}
+}
+
+void Image::build(Blueprint &blueprint, const BuildOptions &options) {
+	m_compress = blueprint.compress;
+	m_sparseMinimumGap = blueprint.sparseMinimumGap;
+	m_symbolFilter = blueprint.symbolFilter;
+	m_stripDebug = blueprint.stripDebug;
+	m_pack = blueprint.pack;
+	m_paddingSaved = 0;
+
+	if (blueprint.prelink)
+		m_prelinker.reset(new Prelinker());
+	m_compression = blueprint.compression;
+	m_options = options;
+
+	if (m_compress && m_sparseMinimumGap != 0)
+		throw std::runtime_error("SPARSE cannot be used with COMPRESS");
+
+	m_pool.reset(new WorkerPool(m_options.jobs));
+
+	planLayout(blueprint);
+
+	if (m_options.dryRun) {
+		m_layout.print();
+		return;
+	}
+
+	loadImage();
+
+	logPrintf("Kickstart executable: %s\n", blueprint.kickstart.c_str());
+
+	loadKickstart(blueprint);
+}
+
+void Image::planLayout(const Blueprint &blueprint) {
 	m_imageBase = blueprint.imageBase;
 	m_allocationPointer = m_imageBase;
+	m_kernelDelta = 0;
 	m_image.clear();
+	m_metadata.clear();
+	m_metadataFixups.clear();
+	m_layout.clear(m_imageBase);
+
+	logPrintf("Image base address: %08X\n", m_imageBase);
+
+	std::vector<const Module *> modules;
+
+	if (blueprint.resolveDependencies) {
+		ModuleDependencies dependencies(*m_files);
+
+		for (const auto &mod : blueprint.modules) {
+			auto infoIt = m_moduleTypes.find(mod.type);
+			dependencies.addModule(mod, infoIt != m_moduleTypes.end() && infoIt->second.type != ModuleType::Binary);
+		}
+
+		modules = dependencies.order();
 
-	printf("Image base address: %08X\n", m_imageBase);
+		for (size_t index = 0; index < modules.size(); index++) {
+			if (modules[index] != &blueprint.modules[index]) {
+				logPrintf("Modules reordered by their dependencies:");
 
-	for (auto &mod : blueprint.modules) {
+				for (auto mod : modules) {
+					logPrintf(" %s", mod->name.c_str());
+				}
+
+				logPrintf("\n");
+				break;
+			}
+		}
+	}
+	else {
+		for (const auto &mod : blueprint.modules) {
+			modules.push_back(&mod);
+		}
+	}
+
+	for (auto modPointer : modules) {
+		auto &mod = *modPointer;
 		writeMetadata(MODINFO_NAME, mod.name.c_str(), mod.name.size() + 1);
 		writeMetadata(MODINFO_TYPE, mod.type.c_str(), mod.type.size() + 1);
 
@@ -72,25 +707,45 @@ void Image::build(Blueprint &blueprint) {
 		}
 
 		auto &info = infoIt->second;
+
+		auto filePointer = m_files->open(mod.fileName);
+		auto &file = *filePointer;
+
+		if (info.type == ModuleType::Binary)
+			alignPayload(BinaryModuleAlignment);
+		else
+			alignPayload(segmentAlignment(file));
+
 		if (info.type == ModuleType::ElfKernel) {
 			alignAllocationPointer(0x00100000); // Kernel base must be aligned to 1MiB
+
+			/*
+			 * Nothing can be placed below the kernel, as the kernel only
+			 * maps memory from its own base up. When packing, the image
+			 * starts at the kernel instead of carrying the gap as zeros.
+			 */
+			if (m_pack && m_layout.regions.empty() && m_imageBase != m_allocationPointer) {
+				logPrintf("Image starts at the kernel base %08X instead of %08X\n", m_allocationPointer, m_imageBase);
+				m_paddingSaved += m_allocationPointer - m_imageBase;
+				m_imageBase = m_allocationPointer;
+				m_layout.imageBase = m_imageBase;
+			}
+
 			m_kernelDelta = m_allocationPointer - KERNEL_VADDR;
-			printf("Kernel physical base: %08X, virtual base: %08X, delta: %08X\n", m_allocationPointer, KERNEL_VADDR, m_kernelDelta);
+			logPrintf("Kernel physical base: %08X, virtual base: %08X, delta: %08X\n", m_allocationPointer, KERNEL_VADDR, m_kernelDelta);
+			m_layout.kernelDelta = m_kernelDelta;
 		}
 
 		uint32_t base = m_allocationPointer;
 		uint32_t size;
-
-		std::ifstream fileStream;
-		fileStream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-		fileStream.open(mod.fileName, std::ios::in | std::ios::binary);
+		uint32_t symbolsStart = base;
+		uint32_t symbolsEnd = base;
 
 		switch (info.type) {
 		case ModuleType::ElfKernel:
 		case ModuleType::ElfModule:
 		{
-			Elf32_Ehdr ehdr;
-			fileStream.read(reinterpret_cast<char *>(&ehdr), sizeof(ehdr));
+			auto ehdr = file.read<Elf32_Ehdr>(0);
 
 			writeMetadata(MODINFO_METADATA | MODINFOMD_ELFHDR, &ehdr, sizeof(ehdr));
 
@@ -112,48 +767,67 @@ void Image::build(Blueprint &blueprint) {
 			}
 			else {
 				virtualBaseDelta = base - m_kernelDelta;
-				printf("elf module %s will have virtual base address %08X and physical base address %08X\n",
+				logPrintf("elf module %s will have virtual base address %08X and physical base address %08X\n",
 					mod.name.c_str(), virtualBaseDelta, base);
 			}
 
-			std::vector<Elf32_Phdr> phdr(ehdr.e_phnum);
+			auto phdr = file.readArray<Elf32_Phdr>(ehdr.e_phoff, ehdr.e_phnum);
+			auto shdr = file.readArray<Elf32_Shdr>(ehdr.e_shoff, ehdr.e_shnum);
 
-			fileStream.seekg(ehdr.e_phoff);
-			fileStream.read(reinterpret_cast<char *>(phdr.data()), phdr.size() * sizeof(Elf32_Phdr));
+			if (ehdr.e_shstrndx >= shdr.size())
+				throw std::runtime_error("Bad section name table index");
+
+			auto &sectionNameSection = shdr[ehdr.e_shstrndx];
+			auto names = file.readArray<char>(sectionNameSection.sh_offset, sectionNameSection.sh_size);
+			names.push_back('\0');
+
+			std::vector<std::pair<uint64_t, uint64_t>> stripped;
+			if (m_stripDebug)
+				stripped = stripDebugSections(shdr, phdr, names);
 
 			for (const auto &segment : phdr) {
 				if (segment.p_type == PT_LOAD) {
+					file.view(segment.p_offset, segment.p_filesz);
+
 					auto physaddr = segment.p_vaddr + virtualBaseDelta + m_kernelDelta;
 
-					printf("Segment physaddr: %08X, image base: %08X\n", physaddr, m_imageBase);
+					logPrintf("Segment physaddr: %08X, image base: %08X\n", physaddr, m_imageBase);
 
 					limit = std::max<uint32_t>(limit, physaddr + segment.p_memsz);
-					if (m_image.size() < limit - m_imageBase) {
-						m_image.resize(limit - m_imageBase);
-					}
 
-					if (segment.p_filesz > 0) {
-						fileStream.seekg(segment.p_offset);
-						fileStream.read(reinterpret_cast<char *>(m_image.data() + physaddr - m_imageBase), segment.p_filesz);
+					/*
+					 * Stripped sections are cut out of the segment and
+					 * left zero.
+					 */
+					uint64_t start = segment.p_offset;
+					uint64_t end = static_cast<uint64_t>(segment.p_offset) + segment.p_filesz;
+
+					for (const auto &range : stripped) {
+						if (range.first >= end || range.second <= start)
+							continue;
+
+						if (range.first > start)
+							m_layout.addFileExtent(physaddr + static_cast<uint32_t>(start - segment.p_offset), mod.fileName, start, static_cast<uint32_t>(range.first - start));
+
+						start = std::max(start, range.second);
 					}
+
+					if (start < end)
+						m_layout.addFileExtent(physaddr + static_cast<uint32_t>(start - segment.p_offset), mod.fileName, start, static_cast<uint32_t>(end - start));
 				} else if (segment.p_type == PT_DYNAMIC && info.type == ModuleType::ElfModule) {
 					writeMetadata32(MODINFO_METADATA | MODINFOMD_DYNAMIC, segment.p_vaddr);
 				}
 			}
 
-			std::vector<Elf32_Shdr> shdr(ehdr.e_shnum);
-			fileStream.seekg(ehdr.e_shoff);
-			fileStream.read(reinterpret_cast<char *>(shdr.data()), shdr.size() * sizeof(Elf32_Shdr));
+			if (m_prelinker && info.type == ModuleType::ElfKernel)
+				m_prelinker->addKernelSymbols(file, shdr);
+			else if (m_prelinker)
+				prelinkModule(mod, file, phdr, shdr, names, virtualBaseDelta);
 
 			writeMetadata(MODINFO_METADATA | MODINFOMD_SHDR, shdr.data(), shdr.size() * sizeof(Elf32_Shdr));
 
-			auto &sectionNameSection = shdr[ehdr.e_shstrndx];
-			std::vector<char> names(sectionNameSection.sh_size);
-			fileStream.seekg(sectionNameSection.sh_offset);
-			fileStream.read(names.data(), names.size());
-
 			for (size_t section = 0; section < ehdr.e_shnum; section++) {
-				if (strcmp(".ctors", names.data() + shdr[section].sh_name) == 0) {
+				if (shdr[section].sh_name < names.size() && strcmp(".ctors", names.data() + shdr[section].sh_name) == 0) {
 					auto &sec = shdr[section];
 
 					writeMetadata32(MODINFO_METADATA | MODINFOMD_CTORS_ADDR, sec.sh_addr);
@@ -181,16 +855,21 @@ void Image::build(Blueprint &blueprint) {
 						}
 					}
 
-					if(doLoad)
-						writeSymbolSection(section, esym, shdr, fileStream);
+					if (doLoad && m_symbolFilter != SymbolFilter::All)
+						writeCompactSymbolTable(section, esym, shdr, file);
+					else if(doLoad)
+						writeSymbolSection(section, esym, shdr, file);
 				}
 			}
 			
-			printf("%s symbol table: %08X - %08X\n", mod.name.c_str(), ssym, esym);
+			logPrintf("%s symbol table: %08X - %08X\n", mod.name.c_str(), ssym, esym);
 
 			limit = esym;
 			size = limit - base;
 
+			symbolsStart = ssym;
+			symbolsEnd = esym;
+
 			writeMetadata32(MODINFO_METADATA | MODINFOMD_SSYM, ssym - m_kernelDelta);
 			writeMetadata32(MODINFO_METADATA | MODINFOMD_ESYM, esym - m_kernelDelta);
 		}
@@ -198,45 +877,41 @@ void Image::build(Blueprint &blueprint) {
 
 		case ModuleType::Binary:
 		{
-			fileStream.seekg(0, std::ios::end);
-			size = static_cast<uint32_t>(fileStream.tellg());
-			fileStream.seekg(0);
+			size = static_cast<uint32_t>(file.size());
 
-			m_image.resize(base + size - m_imageBase);
-			fileStream.read(reinterpret_cast<char *>(m_image.data() + base - m_imageBase), size);
+			m_layout.addFileExtent(base, mod.fileName, 0, size);
 		}
 		break;
 		}
 
 		m_allocationPointer = base + size;
-		alignAllocationPointer(4096);
+
+		auto &region = m_layout.addRegion(LayoutRegionType::Module, mod.name, mod.fileName, base, size);
+		region.symbolsStart = symbolsStart;
+		region.symbolsEnd = symbolsEnd;
+		region.noCompress = mod.noCompress;
 
 		writeMetadata32(MODINFO_ADDR, base - m_kernelDelta);
 		writeMetadata32(MODINFO_SIZE, size);
 		
-		printf("%s module %s (from %s): starts at %08X, length %08X\n", mod.type.c_str(), mod.name.c_str(), mod.fileName.c_str(), base, size);
+		logPrintf("%s module %s (from %s): starts at %08X, length %08X\n", mod.type.c_str(), mod.name.c_str(), mod.fileName.c_str(), base, size);
 
 		for (const auto &metadata : mod.metadata) {
 			switch (metadata.type) {
 			case ModuleMetadataType::DTB:
 			{
+				alignPayload(DTBAlignment);
 				uint32_t dtbBase = m_allocationPointer;
 
-				std::ifstream dtbStream;
-				dtbStream.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
-				dtbStream.open(metadata.singleValue, std::ios::in | std::ios::binary);
-				dtbStream.seekg(0, std::ios::end);
-				uint32_t dtbSize = static_cast<uint32_t>(dtbStream.tellg());
-				dtbStream.seekg(0);
-
-				printf("  DTB data: at %08X (virt %08X), size %08X\n", m_allocationPointer, m_allocationPointer - m_kernelDelta, dtbSize);
+				auto dtbFile = m_files->open(metadata.singleValue);
+				uint32_t dtbSize = static_cast<uint32_t>(dtbFile->size());
 
-				m_image.resize(dtbBase + dtbSize - m_imageBase);
+				logPrintf("  DTB data: at %08X (virt %08X), size %08X\n", m_allocationPointer, m_allocationPointer - m_kernelDelta, dtbSize);
 
-				dtbStream.read(reinterpret_cast<char *>(m_image.data() + dtbBase - m_imageBase), dtbSize);
+				m_layout.addFileExtent(dtbBase, metadata.singleValue, 0, dtbSize);
+				m_layout.addRegion(LayoutRegionType::DTB, mod.name, metadata.singleValue, dtbBase, dtbSize);
 
 				m_allocationPointer += dtbSize;
-				alignAllocationPointer(4096);
 
 				writeMetadata32(MODINFO_METADATA | MODINFOMD_DTBP, dtbBase - m_kernelDelta);
 			}
@@ -250,7 +925,7 @@ void Image::build(Blueprint &blueprint) {
 
 					uint32_t value = m_allocationPointer - m_kernelDelta;
 
-					printf("Fixing up KERNEND: %08X\n", value);
+					logPrintf("Fixing up KERNEND: %08X\n", value);
 
 					memcpy(target, &value, sizeof(value));
 				}, sizeof(uint32_t));
@@ -267,16 +942,16 @@ void Image::build(Blueprint &blueprint) {
 				}
 				environmentBlock.push_back('\0');
 
+				alignPayload(EnvironmentAlignment);
 				uint32_t envBase = m_allocationPointer;
 				uint32_t envSize = environmentBlock.size();
 
-				printf("  Environment: at %08X (virt %08X), size %08X\n", envBase, envBase - m_kernelDelta, envSize);
+				logPrintf("  Environment: at %08X (virt %08X), size %08X\n", envBase, envBase - m_kernelDelta, envSize);
 
-				m_image.resize(envBase + envSize - m_imageBase);
-				memcpy(m_image.data() + envBase - m_imageBase, environmentBlock.data(), envSize);
+				m_layout.addDataExtent(envBase, environmentBlock.data(), envSize);
+				m_layout.addRegion(LayoutRegionType::Environment, mod.name, std::string(), envBase, envSize);
 
 				m_allocationPointer += envSize;
-				alignAllocationPointer(4096);
 
 				writeMetadata32(MODINFO_METADATA | MODINFOMD_ENVP, envBase - m_kernelDelta);
 			}
@@ -291,115 +966,199 @@ void Image::build(Blueprint &blueprint) {
 
 	writeMetadata(MODINFO_END, nullptr, 0);
 
+	alignPayload(MetadataAlignment);
 	m_metadataBase = m_allocationPointer;
 	uint32_t metadataSize = m_metadata.size() * sizeof(uint32_t);
 
-	printf("Metadata: at %08X, size %08X\n", m_metadataBase, metadataSize);
-
-	m_image.resize(m_metadataBase + metadataSize - m_imageBase);
-	memcpy(m_image.data() + m_metadataBase - m_imageBase, m_metadata.data(), metadataSize);
+	logPrintf("Metadata: at %08X, size %08X\n", m_metadataBase, metadataSize);
 
 	m_allocationPointer += metadataSize;
 	alignAllocationPointer(4096);
 
-	m_image.resize(m_allocationPointer - m_imageBase); // Ensure proper zero padding at end
+	m_layout.imageSize = m_allocationPointer - m_imageBase; // Includes zero padding at end
+
+	logPrintf("End of uncompressed image: %08X\n", m_allocationPointer);
 
-	printf("End of uncompressed image: %08X\n", m_allocationPointer);
+	if (m_pack) {
+		logPrintf("Layout packing saved %u bytes of alignment padding\n", m_paddingSaved);
+	}
 
 	/*
 	 * Now that size of the uncompressed image is known, we can fix up relocations in the metadata.
 	 */
 
 	for (const auto &fixup : m_metadataFixups) {
-		fixup.handler(reinterpret_cast<uint8_t *>(m_image.data() + m_metadataBase - m_imageBase + fixup.offset * sizeof(uint32_t)));
+		fixup.handler(reinterpret_cast<uint8_t *>(m_metadata.data() + fixup.offset));
 	}
 
-	if(blueprint.compress) {
-		std::vector<unsigned char> outputBuffer(m_image.size() + 4096);
-		size_t outputBufferUsed = 0;
+	m_layout.addDataExtent(m_metadataBase, m_metadata.data(), metadataSize);
+	m_layout.addRegion(LayoutRegionType::Metadata, "metadata", std::string(), m_metadataBase, metadataSize);
+}
 
-		{
-			LZ4F_cctx *rawCtx;
+void Image::loadImage() {
+	if (!m_compress) {
+		/*
+		 * An uncompressed image is not transformed in any way, so it is
+		 * assembled directly in the output file by writeElf. Large file
+		 * extents at page-aligned offsets are copied there without passing
+		 * through memory at all, provided that they come from files on disk.
+		 */
+
+		uint64_t direct = m_files->onDisk() ? m_layout.markDirectExtents(DirectCopyMinimumSize, 4096) : 0;
+		if (direct != 0) {
+			logPrintf("%" PRIu64 " KiB of module data will be copied directly into the output\n", direct / 1024);
+		}
 
-			LZ4F_preferences_t prefs;
-			memset(&prefs, 0, sizeof(prefs));
-			prefs.frameInfo.blockMode = LZ4F_blockIndependent;
-			prefs.compressionLevel = LZ4HC_CLEVEL_MAX;
+		m_imageDisplacement = 0;
+	}
+	else {
+		planFrames();
+	}
 
-			LZ4F_compressOptions_t opts;
-			memset(&opts, 0, sizeof(opts));
-			opts.stableSrc = 1;
+	if (!m_compress) {
+		return;
+	}
+	else if (m_options.maxMemory == 0) {
+		/*
+		 * The layout is final, so the whole image is allocated once and
+		 * then filled in. Loading runs ahead of compression, which takes
+		 * the frame blocks in order as soon as they have been loaded, so
+		 * that reading the inputs and compressing overlap. Loading is
+		 * mostly waiting for page faults, and gets a few threads of its
+		 * own besides the compression threads.
+		 */
 
-			if (LZ4F_createCompressionContext(&rawCtx, LZ4F_VERSION) != 0)
-				throw std::runtime_error("LZ4F_createCompressionContext failed");
+		m_image.resize(m_layout.imageSize);
 
-			std::unique_ptr<LZ4F_cctx, LZ4FDeleter> context(rawCtx);
+		WorkerPool loadPool(m_pool->jobs() < PipelineLoadJobs ? m_pool->jobs() : PipelineLoadJobs);
+		ExtentLoader loader(m_layout.extents, *m_files, loadPool);
+		LoadPipeline pipeline(loader, m_image.data(), m_image.size(), PipelineChunkSize);
 
-			auto chunk = LZ4F_compressBegin(
-				context.get(),
-				outputBuffer.data() + outputBufferUsed,
-				outputBuffer.size() - outputBufferUsed,
-				&prefs
-			);
+		CompressionSession session(*this);
+		std::vector<uint8_t> compressed;
 
-			if (LZ4F_isError(chunk)) {
-				throw std::runtime_error(LZ4F_getErrorName(chunk));
-			}
+		for (auto &frame : m_frames) {
+			frame.compressedOffset = compressed.size();
 
-			outputBufferUsed += chunk;
+			auto header = session.compressor.begin();
+			compressed.insert(compressed.end(), header.begin(), header.end());
 
-			chunk = LZ4F_compressUpdate(
-				context.get(),
-				outputBuffer.data() + outputBufferUsed,
-				outputBuffer.size() - outputBufferUsed,
-				m_image.data(),
-				m_image.size(),
-				&opts
-			);
+			auto ranges = session.frameRanges(frame);
 
-			if (LZ4F_isError(chunk)) {
-				throw std::runtime_error(LZ4F_getErrorName(chunk));
-			}
+			for (size_t first = 0; first < ranges.size(); ) {
+				size_t loaded = pipeline.wait(frame.offset + ranges[first].offset + ranges[first].size);
+				size_t last = first + 1;
 
-			outputBufferUsed += chunk;
+				while (last < ranges.size() && frame.offset + ranges[last].offset + ranges[last].size <= loaded) {
+					last++;
+				}
+
+				std::vector<FrameCompressor::BlockRange> loadedRanges(ranges.begin() + first, ranges.begin() + last);
 
-			chunk = LZ4F_compressEnd(
-				context.get(),
-				outputBuffer.data() + outputBufferUsed,
-				outputBuffer.size() - outputBufferUsed,
-				&opts
-			);
+				session.update(m_image.data() + frame.offset, frame.offset, loadedRanges, [&](const unsigned char *block, size_t size) {
+					compressed.insert(compressed.end(), block, block + size);
+				});
 
-			if (LZ4F_isError(chunk)) {
-				throw std::runtime_error(LZ4F_getErrorName(chunk));
+				first = last;
 			}
 
-			outputBufferUsed += chunk;
+			auto trailer = session.compressor.end();
+			compressed.insert(compressed.end(), trailer.begin(), trailer.end());
 
+			frame.compressedSize = compressed.size() - frame.compressedOffset;
 		}
 
-		outputBuffer.resize(outputBufferUsed);
+		session.finish();
+		m_compressedBlocks = std::move(session.blocks);
+
+		if (!m_compression.moduleFrames) {
+			InPlaceVerifier verifier;
+			verifier.frame(compressed.data(), compressed.size());
 
-		m_imageDisplacement = m_image.size() - outputBuffer.size();
+			setCompressedSize(compressed.size(), verifier);
 
-		printf("Compressed image at %08X, %08X bytes (%u%% of original)\n",
-			m_imageBase + m_imageDisplacement,
-			outputBuffer.size(), outputBuffer.size() * 100 / m_image.size());
+			/*
+			 * If the compressed image has to start further up than flush
+			 * with the end of the image, it extends past the end, and the
+			 * kickstart is moved up to make room.
+			 */
+			m_allocationPointer = std::max<uint32_t>(m_allocationPointer, m_imageBase + m_imageDisplacement + compressed.size());
+			alignAllocationPointer(4096);
+		}
+		// Otherwise, once the kickstart is placed
+
+		m_image = std::move(compressed);
+	}
+	else {
+		logPrintf("Image will be streamed to the output with a memory budget of %zu KiB\n", m_options.maxMemory / 1024);
 
-		m_image = std::move(outputBuffer);
-	} else {
 		m_imageDisplacement = 0;
+
+		if (!m_compression.moduleFrames) {
+			/*
+			 * The kickstart is placed before the image is compressed, so
+			 * room for the compressed image to extend past the end of the
+			 * image is reserved up front: as much as the frame can grow
+			 * over the image, plus the decoder overrun.
+			 */
+			auto prefs = CompressionSession::preferences(m_compression);
+			size_t reserve = LZ4F_compressFrameBound(m_layout.imageSize, &prefs) - m_layout.imageSize + InPlaceVerifier::DecoderOverrun;
+
+			logPrintf("Reserving %zu bytes past the end of the image for in-place decompression\n", reserve);
+
+			m_allocationPointer += static_cast<uint32_t>(reserve);
+			alignAllocationPointer(4096);
+		}
+	}
+}
+
+void Image::planFrames() {
+	m_frames.clear();
+
+	std::vector<size_t> starts{ 0 };
+
+	if (m_compression.moduleFrames) {
+		/*
+		 * One frame per layout region. Every frame extends up to the start
+		 * of the next one, so that padding is covered as well; the first
+		 * one also covers everything below the first region.
+		 */
+
+		for (auto boundary : m_layout.regionBoundaries()) {
+			if (boundary > starts.back() && boundary < m_layout.imageSize)
+				starts.push_back(boundary);
+		}
+	}
+
+	for (size_t index = 0; index < starts.size(); index++) {
+		size_t end = index + 1 < starts.size() ? starts[index + 1] : m_layout.imageSize;
+		m_frames.push_back(ImageFrame{ starts[index], end - starts[index], 0, 0 });
 	}
+}
 
-	printf("Kickstart executable: %s\n", blueprint.kickstart.c_str());
+void Image::writeFrameTable() {
+	auto table = reinterpret_cast<uint32_t *>(m_kickstart.data() + m_frameTable - m_kickstartBase);
+
+	for (const auto &frame : m_frames) {
+		*table++ = static_cast<uint32_t>(m_framesBase + frame.compressedOffset);
+		*table++ = static_cast<uint32_t>(frame.compressedSize);
+		*table++ = static_cast<uint32_t>(m_imageBase + frame.offset);
+		*table++ = static_cast<uint32_t>(frame.size);
+	}
+
+	for (size_t word = 0; word < 4; word++) {
+		*table++ = 0;
+	}
+}
 
+void Image::loadKickstart(const Blueprint &blueprint) {
 	m_kickstartBase = m_allocationPointer;
 	loadExecutable(blueprint.kickstart, m_kickstart, m_kickstartEntry);
 
 	auto kickstartInfo = reinterpret_cast<uint32_t *>(m_kickstart.data());
 	kickstartInfo[0] = m_metadataBase - m_kernelDelta;
 	kickstartInfo[1] = m_kernelEntryPoint + m_kernelDelta;
-	kickstartInfo[2] = m_imageBase + m_imageDisplacement;
+	kickstartInfo[2] = m_imageBase + m_imageDisplacement; // Updated by writeElf when streaming
 	kickstartInfo[3] = m_imageBase;
 
 	if (blueprint.initModules.empty()) {
@@ -426,7 +1185,7 @@ void Image::build(Blueprint &blueprint) {
 
 			auto moduleLimit = m_allocationPointer;
 
-			printf("Module %s: at %08X, limit %08X, entry %08X\n", initModule.c_str(), moduleBase, moduleLimit, imageEntry);
+			logPrintf("Module %s: at %08X, limit %08X, entry %08X\n", initModule.c_str(), moduleBase, moduleLimit, imageEntry);
 
 			m_kickstart.resize(moduleLimit - m_kickstartBase);
 			std::copy(imageData.begin(), imageData.end(), m_kickstart.begin() + (moduleBase - m_kickstartBase));
@@ -438,15 +1197,52 @@ void Image::build(Blueprint &blueprint) {
 		reinterpret_cast<uint32_t *>(m_kickstart.data() + moduleTable - m_kickstartBase)[index] = 0;
 	}
 
+	if (m_compress && m_compression.moduleFrames) {
+		/*
+		 * With one frame per module, the kickstart gets a table of
+		 * { source, source size, destination, destination size } entries,
+		 * terminated by a zero entry, instead of a single source address.
+		 * The table address goes into a sixth information word, which
+		 * the kickstart has to declare by holding the marker there;
+		 * otherwise the word belongs to the kickstart code or data.
+		 */
+
+		if (m_kickstart.size() < sizeof(uint32_t) * (KickstartInfoWords + 1) ||
+			reinterpret_cast<const uint32_t *>(m_kickstart.data())[KickstartInfoWords] != KickstartFrameTableMarker) {
+
+			std::stringstream error;
+			error << "Kickstart " << blueprint.kickstart << " does not support MODULE_FRAMES: its sixth information word must hold the frame table marker 0x"
+				<< std::hex << KickstartFrameTableMarker;
+			throw std::runtime_error(error.str());
+		}
+
+		alignAllocationPointer(4);
+		m_frameTable = m_allocationPointer;
+		m_allocationPointer += sizeof(uint32_t) * 4 * (m_frames.size() + 1);
+		m_kickstart.resize(m_allocationPointer - m_kickstartBase);
+
+		alignAllocationPointer(4096);
+		m_framesBase = m_allocationPointer;
+
+		kickstartInfo = reinterpret_cast<uint32_t *>(m_kickstart.data());
+		kickstartInfo[2] = 0;
+		kickstartInfo[KickstartInfoWords] = m_frameTable;
+
+		logPrintf("Frame table: at %08X, %zu frames, compressed frames at %08X\n", m_frameTable, m_frames.size(), m_framesBase);
+
+		if (m_options.maxMemory == 0) {
+			setCompressedSize(m_image.size());
+			writeFrameTable();
+		}
+	}
+
 }
 
 void Image::loadExecutable(const std::string &executable, std::vector<unsigned char> &image, uint32_t &entry) {
-	std::ifstream fileStream;
-	fileStream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-	fileStream.open(executable, std::ios::in | std::ios::binary);
+	auto filePointer = m_files->open(executable);
+	auto &file = *filePointer;
 
-	Elf32_Ehdr ehdr;
-	fileStream.read(reinterpret_cast<char *>(&ehdr), sizeof(ehdr));
+	auto ehdr = file.read<Elf32_Ehdr>(0);
 
 	uint32_t base = m_allocationPointer;
 	uint32_t limit = m_allocationPointer;
@@ -461,10 +1257,7 @@ void Image::loadExecutable(const std::string &executable, std::vector<unsigned c
 
 	entry = ehdr.e_entry + base;
 
-	std::vector<Elf32_Phdr> phdr(ehdr.e_phnum);
-
-	fileStream.seekg(ehdr.e_phoff);
-	fileStream.read(reinterpret_cast<char *>(phdr.data()), phdr.size() * sizeof(Elf32_Phdr));
+	auto phdr = file.readArray<Elf32_Phdr>(ehdr.e_phoff, ehdr.e_phnum);
 
 	for (const auto &segment : phdr) {
 		if (segment.p_type == PT_LOAD) {
@@ -477,19 +1270,15 @@ void Image::loadExecutable(const std::string &executable, std::vector<unsigned c
 			}
 
 			if (segment.p_filesz > 0) {
-				fileStream.seekg(segment.p_offset);
-				fileStream.read(reinterpret_cast<char *>(image.data() + physaddr - base), segment.p_filesz);
+				memcpy(image.data() + physaddr - base, file.view(segment.p_offset, segment.p_filesz), segment.p_filesz);
 			}
 		}
 	}
 
 	uint32_t kickstartSize = allocationLimit - base;
-	printf("Kickstart module at %08X, size %08X\n", base, kickstartSize);
-
-	std::vector<Elf32_Shdr> shdr(ehdr.e_shnum);
+	logPrintf("Kickstart module at %08X, size %08X\n", base, kickstartSize);
 
-	fileStream.seekg(ehdr.e_shoff);
-	fileStream.read(reinterpret_cast<char *>(shdr.data()), shdr.size() * sizeof(Elf32_Shdr));
+	auto shdr = file.readArray<Elf32_Shdr>(ehdr.e_shoff, ehdr.e_shnum);
 
 	for (const auto &section : shdr) {
 		if (section.sh_type == SHT_REL) {
@@ -497,9 +1286,7 @@ void Image::loadExecutable(const std::string &executable, std::vector<unsigned c
 				throw std::runtime_error("bad relocation section size");
 			}
 
-			std::vector<Elf32_Rel> relocations(section.sh_size / sizeof(Elf32_Rel));
-			fileStream.seekg(section.sh_offset);
-			fileStream.read(reinterpret_cast<char *>(relocations.data()), relocations.size() * sizeof(Elf32_Rel));
+			auto relocations = file.readArray<Elf32_Rel>(section.sh_offset, section.sh_size / sizeof(Elf32_Rel));
 			processImageRelocations(image, base, relocations);
 		}
 		else if (section.sh_type == SHT_RELA) {
@@ -507,9 +1294,7 @@ void Image::loadExecutable(const std::string &executable, std::vector<unsigned c
 				throw std::runtime_error("bad relocation section size");
 			}
 
-			std::vector<Elf32_Rela> relocations(section.sh_size / sizeof(Elf32_Rela));
-			fileStream.seekg(section.sh_offset);
-			fileStream.read(reinterpret_cast<char *>(relocations.data()), relocations.size() * sizeof(Elf32_Rela));
+			auto relocations = file.readArray<Elf32_Rela>(section.sh_offset, section.sh_size / sizeof(Elf32_Rela));
 			processImageRelocations(image, base, relocations);
 		}
 	}
@@ -576,43 +1361,208 @@ void Image::writeMetadata32(uint32_t type, uint32_t value) {
 	writeMetadata(type, &value, sizeof(value));
 }
 
+void Image::setCompressedSize(size_t compressedSize, const InPlaceVerifier &verifier) {
+	if (verifier.decodedSize() != m_layout.imageSize)
+		throw std::logic_error("Compressed image does not decode to the image size");
+
+	/*
+	 * The compressed image is decompressed in place, so it starts no lower
+	 * than the verified minimum displacement. Where possible, it ends flush
+	 * with the end of the image.
+	 */
+
+	size_t minimum = verifier.minimumDisplacement();
+	size_t displacement = minimum;
+
+	/*
+	 * A compressed image that is no smaller than the image (e.g. with
+	 * large stored payloads, which cost 4 bytes per block) cannot end
+	 * flush with the image, and always extends past its end.
+	 */
+	if (compressedSize < m_layout.imageSize)
+		displacement = std::max(displacement, m_layout.imageSize - compressedSize);
+
+	m_imageDisplacement = static_cast<uint32_t>(displacement);
+
+	size_t compressedEnd = displacement + compressedSize;
+
+	logPrintf("In-place decompression: minimum displacement %08zX, %zu bytes past the end of the image\n",
+		minimum, compressedEnd > m_layout.imageSize ? compressedEnd - m_layout.imageSize : 0);
+
+	logPrintf("Compressed image at %08X, %08zX bytes (%zu%% of original)\n",
+		m_imageBase + m_imageDisplacement,
+		compressedSize, compressedSize * 100 / m_layout.imageSize);
+}
+
+void Image::setCompressedSize(size_t compressedSize) {
+	/*
+	 * MODULE_FRAMES: frames are decompressed independently, so none of them
+	 * may be overwritten by the output of another. They are kept past the
+	 * end of the kickstart instead of inside the image.
+	 */
+
+	m_imageDisplacement = m_framesBase - m_imageBase;
+
+	logPrintf("Compressed image at %08X, %zu frames, %08zX bytes (%zu%% of original)\n",
+		m_framesBase, m_frames.size(),
+		compressedSize, compressedSize * 100 / m_layout.imageSize);
+}
+
+void Image::alignPayload(uint32_t alignment) {
+	uint32_t pageAligned = (m_allocationPointer + 4095) & ~4095;
+
+	if (m_pack) {
+		alignAllocationPointer(alignment);
+
+		if (m_allocationPointer < pageAligned)
+			m_paddingSaved += pageAligned - m_allocationPointer;
+	}
+	else {
+		m_allocationPointer = pageAligned;
+	}
+}
+
+uint32_t Image::segmentAlignment(const InputFile &file) {
+	auto ehdr = file.read<Elf32_Ehdr>(0);
+	auto phdr = file.readArray<Elf32_Phdr>(ehdr.e_phoff, ehdr.e_phnum);
+
+	uint32_t alignment = 4;
+
+	for (const auto &segment : phdr) {
+		if (segment.p_type == PT_LOAD && segment.p_align > alignment)
+			alignment = segment.p_align;
+	}
+
+	if ((alignment & (alignment - 1)) != 0)
+		throw std::runtime_error(file.fileName() + ": segment alignment is not a power of two");
+
+	return alignment;
+}
+
 void Image::alignAllocationPointer(uint32_t alignment) {
 	m_allocationPointer = (m_allocationPointer + (alignment - 1)) & ~(alignment - 1);
 }
 
+void Image::printBootReport() const {
+	BootCostModel model(m_layout, m_options.bootProfile);
+
+	for (const auto &segment : m_segments) {
+		model.addSegment(m_imageBase + static_cast<uint32_t>(segment.offset), segment.fileSize, segment.memorySize);
+	}
+
+	model.addSegment(m_kickstartBase, m_kickstart.size(), m_allocationPointer - m_kickstartBase);
+
+	for (const auto &block : m_compressedBlocks) {
+		model.addBlock(block.offset, block.size, block.compressedSize, block.stored);
+	}
+
+	model.print();
+}
+
 void Image::writeElf(const std::string &filename) {
-	std::ofstream stream;
-	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
-	stream.open(filename, std::ios::out | std::ios::trunc | std::ios::binary);
-	writeElf(stream);
+	std::vector<DeferredCopy> deferred;
+
+	{
+		std::ofstream stream;
+		stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+		stream.open(filename, std::ios::out | std::ios::trunc | std::ios::binary);
+		writeElf(stream, &deferred);
+	}
+
+	uint64_t cloned = 0;
+	uint64_t copied = 0;
+
+	for (const auto &copy : deferred) {
+		auto extent = copy.extent;
+		auto method = copyFileRange(extent->fileName, extent->fileOffset, filename, copy.fileOffset, extent->size);
+
+		if (method == FileCopyMethod::Clone)
+			cloned += extent->size;
+		else
+			copied += extent->size;
+	}
+
+	if (!deferred.empty()) {
+		logPrintf("Direct copy: %" PRIu64 " KiB cloned, %" PRIu64 " KiB copied\n", cloned / 1024, copied / 1024);
+	}
 }
 
 void Image::writeElf(std::ostream &stream) {
-	size_t dataPos = 4096;
+	writeElf(stream, nullptr);
+}
+
+void Image::writeElf(std::vector<uint8_t> &output) {
+	output.clear();
+
+	OutputBuffer buffer(output);
+	std::ostream stream(&buffer);
+	stream.exceptions(std::ios::failbit | std::ios::eofbit | std::ios::badbit);
+	writeElf(stream, nullptr);
+}
 
-	std::vector<Elf32_Phdr> phdrs(2);
+void Image::writeElf(std::ostream &stream, std::vector<DeferredCopy> *deferred) {
+	std::vector<ImageSegment> segments;
 
-	auto &imagePhdr = phdrs[0];
-	imagePhdr.p_type = PT_LOAD;
-	imagePhdr.p_offset = dataPos;
-	imagePhdr.p_vaddr = m_imageBase + m_imageDisplacement;
-	imagePhdr.p_paddr = m_imageBase + m_imageDisplacement;
-	imagePhdr.p_filesz = m_image.size();
-	imagePhdr.p_memsz = m_image.size();
-	imagePhdr.p_flags = PF_R | PF_W | PF_X;
-	imagePhdr.p_align = 4096;
+	stream.seekp(ImageDataOffset);
 
-	dataPos += (imagePhdr.p_filesz + 4095) & ~4095;
+	if (m_compress && m_options.maxMemory == 0) {
+		stream.write(reinterpret_cast<char *>(m_image.data()), m_image.size());
+		segments.push_back(ImageSegment{ m_imageDisplacement, ImageDataOffset, m_image.size(), m_image.size() });
+	}
+	else {
+		segments = streamImage(stream, deferred);
+	}
+
+	std::vector<Elf32_Phdr> phdrs;
+	uint64_t dataPos = ImageDataOffset;
+
+	for (const auto &segment : segments) {
+		phdrs.emplace_back();
+		auto &imagePhdr = phdrs.back();
+		imagePhdr.p_type = PT_LOAD;
+		imagePhdr.p_offset = static_cast<Elf32_Off>(segment.fileOffset);
+		imagePhdr.p_vaddr = static_cast<Elf32_Addr>(m_imageBase + segment.offset);
+		imagePhdr.p_paddr = static_cast<Elf32_Addr>(m_imageBase + segment.offset);
+		imagePhdr.p_filesz = static_cast<Elf32_Word>(segment.fileSize);
+		imagePhdr.p_memsz = static_cast<Elf32_Word>(segment.memorySize);
+		imagePhdr.p_flags = PF_R | PF_W | PF_X;
+		imagePhdr.p_align = 4096;
+
+		dataPos = std::max<uint64_t>(dataPos, segment.fileOffset + segment.fileSize);
+	}
+
+	dataPos = (dataPos + 4095) & ~static_cast<uint64_t>(4095);
+
+	m_segments = segments;
+
+	if (m_sparseMinimumGap != 0) {
+		size_t fileBytes = 0;
+		for (const auto &segment : segments) {
+			fileBytes += segment.fileSize;
+		}
+
+		logPrintf("Sparse image: %zu segments, %zu KiB of %zu KiB stored\n", segments.size(), fileBytes / 1024, m_layout.imageSize / 1024);
+	}
 
-	auto &kickstartPhdr = phdrs[1];
+	Elf32_Phdr kickstartPhdr;
+	memset(&kickstartPhdr, 0, sizeof(kickstartPhdr));
 	kickstartPhdr.p_type = PT_LOAD;
-	kickstartPhdr.p_offset = dataPos;
+	kickstartPhdr.p_offset = static_cast<Elf32_Off>(dataPos);
 	kickstartPhdr.p_vaddr = m_kickstartBase;
 	kickstartPhdr.p_paddr = m_kickstartBase;
 	kickstartPhdr.p_filesz = m_kickstart.size();
 	kickstartPhdr.p_memsz = m_allocationPointer - m_kickstartBase;
 	kickstartPhdr.p_flags = PF_R | PF_W | PF_X;
 	kickstartPhdr.p_align = 4096;
+	phdrs.push_back(kickstartPhdr);
+
+	/*
+	 * PT_LOAD entries have to be in ascending order of address, and with
+	 * MODULE_FRAMES the compressed image is placed above the kickstart.
+	 */
+	std::stable_sort(phdrs.begin(), phdrs.end(), [](const Elf32_Phdr &a, const Elf32_Phdr &b) {
+		return a.p_vaddr < b.p_vaddr;
+	});
 
 	Elf32_Ehdr ehdr;
 	memset(&ehdr, 0, sizeof(ehdr));
@@ -625,14 +1575,140 @@ void Image::writeElf(std::ostream &stream) {
 	ehdr.e_ehsize = sizeof(ehdr);
 	ehdr.e_phentsize = sizeof(Elf32_Phdr);
 	ehdr.e_phnum = static_cast<Elf32_Half>(phdrs.size());
-	stream.write(reinterpret_cast<char *>(&ehdr), sizeof(ehdr));
-	stream.write(reinterpret_cast<char *>(phdrs.data()), phdrs.size() * sizeof(Elf32_Phdr));
-	stream.seekp(imagePhdr.p_offset);
-	stream.write(reinterpret_cast<char *>(m_image.data()), imagePhdr.p_filesz);
 	stream.seekp(kickstartPhdr.p_offset);
 	stream.write(reinterpret_cast<char *>(m_kickstart.data()), kickstartPhdr.p_filesz);
+	stream.seekp(0);
+	stream.write(reinterpret_cast<char *>(&ehdr), sizeof(ehdr));
+	stream.write(reinterpret_cast<char *>(phdrs.data()), phdrs.size() * sizeof(Elf32_Phdr));
 }
 
+std::vector<Image::ImageSegment> Image::streamImage(std::ostream &stream, std::vector<DeferredCopy> *deferred) {
+	/*
+	 * The image is produced window by window, so that no more than about
+	 * maxMemory bytes of image data, uncompressed and compressed, are held
+	 * at any time. Windows consist of whole frame blocks, which makes the
+	 * image data identical to that of an in-memory build.
+	 */
+
+	ExtentLoader loader(m_layout.extents, *m_files, *m_pool);
+	std::vector<uint8_t> window;
+	size_t written = 0;
+
+	if (!m_compress) {
+		size_t windowSize = m_options.maxMemory == 0 ? DefaultWindowSize : std::max<size_t>(m_options.maxMemory & ~static_cast<size_t>(4095), 4096);
+
+		std::vector<const LayoutExtent *> direct;
+		for (const auto &extent : m_layout.extents) {
+			if (extent.direct)
+				direct.push_back(&extent);
+		}
+
+		std::sort(direct.begin(), direct.end(), [](const LayoutExtent *a, const LayoutExtent *b) {
+			return a->offset < b->offset;
+		});
+
+		SegmentWriter writer(stream, m_sparseMinimumGap, *m_files, deferred);
+		size_t offset = 0;
+
+		for (size_t index = 0; index <= direct.size(); index++) {
+			size_t gapEnd = index < direct.size() ? direct[index]->offset : m_layout.imageSize;
+
+			/*
+			 * Following a direct extent that does not end at a page
+			 * boundary, the first window only extends up to the next
+			 * one, so that windows are made of whole image pages.
+			 */
+			for (; offset < gapEnd; offset += window.size()) {
+				window.resize(std::min(windowSize - offset % 4096, gapEnd - offset));
+				loader.load(offset, window.data(), window.size());
+				writer.write(offset, window.data(), window.size());
+			}
+
+			if (index == direct.size())
+				break;
+
+			writer.writeDirect(*direct[index]);
+			offset = direct[index]->offset + direct[index]->size;
+		}
+
+		return writer.finish(m_layout.imageSize);
+	}
+
+	CompressionSession session(*this);
+
+	size_t windowSize = std::max<size_t>(m_options.maxMemory / 2, session.settings.blockSize);
+	InPlaceVerifier verifier;
+
+	for (auto &frame : m_frames) {
+		auto ranges = session.frameRanges(frame);
+		for (auto &range : ranges) {
+			range.offset += frame.offset;
+		}
+
+		frame.compressedOffset = written;
+
+		auto header = session.compressor.begin();
+		stream.write(reinterpret_cast<char *>(header.data()), header.size());
+		written += header.size();
+		verifier.header(header.size());
+
+		for (size_t first = 0; first < ranges.size(); ) {
+			size_t windowStart = ranges[first].offset;
+			size_t last = first + 1;
+
+			while (last < ranges.size() && ranges[last].offset + ranges[last].size - windowStart <= windowSize) {
+				last++;
+			}
+
+			size_t windowEnd = ranges[last - 1].offset + ranges[last - 1].size;
+
+			window.resize(windowEnd - windowStart);
+			loader.load(windowStart, window.data(), window.size());
+
+			std::vector<FrameCompressor::BlockRange> windowRanges(ranges.begin() + first, ranges.begin() + last);
+			for (auto &range : windowRanges) {
+				range.offset -= windowStart;
+			}
+
+			session.update(window.data(), windowStart, windowRanges, [&](const unsigned char *block, size_t size) {
+				stream.write(reinterpret_cast<const char *>(block), size);
+				written += size;
+				verifier.block(block, size);
+			});
+
+			first = last;
+		}
+
+		auto trailer = session.compressor.end();
+		stream.write(reinterpret_cast<char *>(trailer.data()), trailer.size());
+		written += trailer.size();
+		verifier.trailer(trailer.size());
+
+		frame.compressedSize = written - frame.compressedOffset;
+	}
+
+	session.finish();
+	m_compressedBlocks = std::move(session.blocks);
+
+	if (m_compression.moduleFrames) {
+		setCompressedSize(written);
+		writeFrameTable();
+	}
+	else {
+		setCompressedSize(written, verifier);
+
+		if (m_imageBase + m_imageDisplacement + written > m_kickstartBase) {
+			std::stringstream error;
+			error << "Compressed image does not fit below the kickstart for safe in-place decompression ("
+				<< (m_imageBase + m_imageDisplacement + written - m_kickstartBase) << " bytes missing); build without --max-memory";
+			throw std::runtime_error(error.str());
+		}
+
+		reinterpret_cast<uint32_t *>(m_kickstart.data())[2] = m_imageBase + m_imageDisplacement;
+	}
+
+	return std::vector<ImageSegment>{ ImageSegment{ m_imageDisplacement, ImageDataOffset, written, written } };
+}
 
 const std::unordered_map<std::string, Image::ModuleTypeInfo> Image::m_moduleTypes{
 	{ "elf kernel", { ModuleType::ElfKernel } },
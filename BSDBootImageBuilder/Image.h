@@ -4,10 +4,21 @@
 #include <unordered_map>
 #include <string>
 #include <functional>
+#include <memory>
+#include <vector>
 
-class Blueprint;
+#include "Blueprint.h"
+#include "BuildOptions.h"
+#include "Layout.h"
 
+struct Elf32_Phdr;
 struct Elf32_Shdr;
+class BlockCache;
+class FileProvider;
+class InPlaceVerifier;
+class InputFile;
+class Prelinker;
+class WorkerPool;
 
 class Image {
 public:
@@ -17,10 +28,34 @@ public:
 	Image(const Image &other) = delete;
 	Image &operator =(const Image &other) = delete;
 
-	void build(Blueprint &blueprint);
+	/*
+	 * Input files named by the blueprint are opened through the file
+	 * provider, which defaults to files on disk. The provider must
+	 * outlive the image.
+	 */
+	void setFileProvider(FileProvider &files);
+
+	/*
+	 * Uses the given block cache instead of one in the block cache
+	 * directory of the build options. The cache must outlive the image.
+	 */
+	void setBlockCache(BlockCache *cache);
+
+	void build(Blueprint &blueprint, const BuildOptions &options);
 
 	void writeElf(const std::string &filename);
 	void writeElf(std::ostream &stream);
+	void writeElf(std::vector<uint8_t> &output);
+
+	inline const Layout &layout() const {
+		return m_layout;
+	}
+
+	/*
+	 * Prints the boot time estimate for the written image, using the boot
+	 * profile from the build options.
+	 */
+	void printBootReport() const;
 
 private:
 	enum class ModuleType {
@@ -38,11 +73,68 @@ private:
 		std::function<void(uint8_t *data)> handler;
 	};
 
+	/*
+	 * A PT_LOAD segment of the image in the output file. Bytes between
+	 * fileSize and memorySize are zero.
+	 */
+	struct ImageSegment {
+		size_t offset; // Relative to the image base
+		uint64_t fileOffset;
+		size_t fileSize;
+		size_t memorySize;
+	};
+
+	/*
+	 * A direct extent left as a hole in the output, to be copied from its
+	 * file once the output stream is closed.
+	 */
+	struct DeferredCopy {
+		const LayoutExtent *extent;
+		uint64_t fileOffset;
+	};
+
+	/*
+	 * An independently compressed LZ4 frame of the image. There is a
+	 * single frame covering the whole image unless MODULE_FRAMES is used.
+	 */
+	struct ImageFrame {
+		size_t offset; // Relative to the image base
+		size_t size;
+		size_t compressedOffset; // Relative to the start of compressed data
+		size_t compressedSize;
+	};
+
+	/*
+	 * An LZ4 block of the compressed image, as emitted.
+	 */
+	struct CompressedBlock {
+		size_t offset; // Of the uncompressed data, relative to the image base
+		size_t size;
+		size_t compressedSize;
+		bool stored;
+	};
+
+	struct CompressionSession;
+	struct SegmentWriter;
+
+	void planLayout(const Blueprint &blueprint);
+	void loadImage();
+	void loadKickstart(const Blueprint &blueprint);
+	void planFrames();
+	void writeFrameTable();
+
+	void setCompressedSize(size_t compressedSize);
+	void setCompressedSize(size_t compressedSize, const InPlaceVerifier &verifier);
+	void writeElf(std::ostream &stream, std::vector<DeferredCopy> *deferred);
+	std::vector<ImageSegment> streamImage(std::ostream &stream, std::vector<DeferredCopy> *deferred);
+
 	void writeMetadata(uint32_t type, const void *data, size_t dataSize);
 	void writeMetadata32(uint32_t type, uint32_t value);
 	void writeMetadataFixup(uint32_t type, std::function<void(uint8_t *data)> &&fixup, size_t length);
 
 	void alignAllocationPointer(uint32_t alignment);
+	void alignPayload(uint32_t alignment);
+	static uint32_t segmentAlignment(const InputFile &file);
 
 	template<typename T>
 	void processImageRelocations(std::vector<unsigned char> &image, uint32_t base, const std::vector<T> &relocations);
@@ -51,7 +143,26 @@ private:
 
 	static const std::unordered_map<std::string, ModuleTypeInfo> m_moduleTypes;
 
-	void writeSymbolSection(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, std::istream &fileStream);
+	static const size_t ImageDataOffset = 4096; // Of the image in the output file
+	static const uint32_t DirectCopyMinimumSize = 1024 * 1024;
+	static const size_t DefaultWindowSize = 16 * 1024 * 1024; // For uncompressed images
+	static const size_t KickstartInfoWords = 5; // Kickstart information words written for every image
+	static const uint32_t KickstartFrameTableMarker = 0x4C425446; // "FTBL", in the sixth word of kickstarts supporting MODULE_FRAMES
+	static const size_t PipelineChunkSize = 4 * 1024 * 1024; // Of image data loaded at a time ahead of compression
+	static const unsigned int PipelineLoadJobs = 4; // Threads loading ahead of compression
+
+	// Alignments of payloads when packing; everything is page aligned otherwise
+	static const uint32_t BinaryModuleAlignment = 4096;
+	static const uint32_t DTBAlignment = 8;
+	static const uint32_t EnvironmentAlignment = 4;
+	static const uint32_t MetadataAlignment = 8;
+
+	void writeSymbolSection(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, const InputFile &file);
+	std::vector<std::pair<uint64_t, uint64_t>> stripDebugSections(std::vector<Elf32_Shdr> &sections, const std::vector<Elf32_Phdr> &segments,
+		const std::vector<char> &names);
+	void prelinkModule(const Module &mod, const InputFile &file, const std::vector<Elf32_Phdr> &segments,
+		const std::vector<Elf32_Shdr> &sections, const std::vector<char> &sectionNames, uint32_t virtualBase);
+	void writeCompactSymbolTable(const Elf32_Shdr &section, uint32_t &esym, const std::vector<Elf32_Shdr> &sections, const InputFile &file);
 
 	std::vector<uint32_t> m_metadata;
 	uint32_t m_imageBase;
@@ -62,9 +173,27 @@ private:
 	uint32_t m_kickstartBase;
 	uint32_t m_kickstartEntry;
 	uint32_t m_imageDisplacement;
+	bool m_compress;
+	uint32_t m_sparseMinimumGap;
+	SymbolFilter m_symbolFilter;
+	bool m_stripDebug;
+	bool m_pack;
+	uint32_t m_paddingSaved;
+	CompressionSettings m_compression;
+	BuildOptions m_options;
+	FileProvider *m_files;
+	BlockCache *m_blockCache;
 	std::vector<uint8_t> m_image;
 	std::vector<uint8_t> m_kickstart;
 	std::vector<MetadataFixup> m_metadataFixups;
+	Layout m_layout;
+	std::vector<ImageFrame> m_frames;
+	std::vector<CompressedBlock> m_compressedBlocks;
+	std::vector<ImageSegment> m_segments; // Of the image in the output file, excluding the kickstart
+	uint32_t m_frameTable;
+	uint32_t m_framesBase;
+	std::unique_ptr<WorkerPool> m_pool;
+	std::unique_ptr<Prelinker> m_prelinker;
 };
 
 #endif
@@ -0,0 +1,149 @@
+#include "InPlaceVerifier.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+static uint32_t readLE32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+InPlaceVerifier::InPlaceVerifier() : m_input(0), m_output(0), m_margin(0) {
+
+}
+
+InPlaceVerifier::~InPlaceVerifier() {
+
+}
+
+void InPlaceVerifier::frame(const uint8_t *data, size_t size) {
+	/*
+	 * Magic, FLG and BD, optional content size and dictionary ID, and the
+	 * header checksum.
+	 */
+
+	if (size < 7 || readLE32(data) != 0x184D2204)
+		throw std::runtime_error("Not an LZ4 frame");
+
+	uint8_t flags = data[4];
+	size_t headerSize = 7 + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+	bool blockChecksum = (flags & 0x10) != 0;
+	bool contentChecksum = (flags & 0x04) != 0;
+
+	if (size < headerSize)
+		throw std::runtime_error("Truncated LZ4 frame header");
+
+	header(headerSize);
+
+	size_t position = headerSize;
+
+	while (true) {
+		if (size - position < 4)
+			throw std::runtime_error("Truncated LZ4 frame");
+
+		uint32_t blockSize = readLE32(data + position) & 0x7FFFFFFF;
+		if (blockSize == 0)
+			break;
+
+		size_t total = 4 + static_cast<size_t>(blockSize) + (blockChecksum ? 4 : 0);
+		if (size - position < total)
+			throw std::runtime_error("Truncated LZ4 block");
+
+		block(data + position, total);
+		position += total;
+	}
+
+	trailer(4 + (contentChecksum ? 4 : 0));
+}
+
+void InPlaceVerifier::header(size_t size) {
+	m_input += size;
+}
+
+void InPlaceVerifier::block(const uint8_t *data, size_t size) {
+	if (size < 4)
+		throw std::runtime_error("Truncated LZ4 block");
+
+	uint32_t word = readLE32(data);
+	size_t blockSize = word & 0x7FFFFFFF;
+
+	if (blockSize > size - 4)
+		throw std::runtime_error("Truncated LZ4 block");
+
+	size_t checksumSize = size - 4 - blockSize;
+
+	m_input += 4;
+
+	if (word & 0x80000000) {
+		m_input += blockSize;
+		write(blockSize);
+	}
+	else {
+		/*
+		 * Literals are written once they have been read; a match is written
+		 * after its offset and length have been read.
+		 */
+
+		const uint8_t *ip = data + 4;
+		const uint8_t *end = ip + blockSize;
+		size_t blockOutput = 0;
+
+		auto consume = [&](size_t count) {
+			if (static_cast<size_t>(end - ip) < count)
+				throw std::runtime_error("Malformed LZ4 block: truncated sequence");
+
+			ip += count;
+			m_input += count;
+		};
+
+		auto readLength = [&](size_t length) {
+			if (length == 15) {
+				uint8_t byte;
+				do {
+					consume(1);
+					byte = ip[-1];
+					length += byte;
+				} while (byte == 255);
+			}
+
+			return length;
+		};
+
+		while (true) {
+			consume(1);
+			uint8_t token = ip[-1];
+
+			size_t literals = readLength(token >> 4);
+			consume(literals);
+			write(literals);
+			blockOutput += literals;
+
+			if (ip == end)
+				break; // The last sequence has literals only
+
+			consume(2);
+			size_t offset = ip[-2] | (ip[-1] << 8);
+			if (offset == 0 || offset > blockOutput)
+				throw std::runtime_error("Malformed LZ4 block: bad match offset");
+
+			size_t match = readLength(token & 15) + 4;
+			write(match);
+			blockOutput += match;
+		}
+	}
+
+	m_input += checksumSize;
+}
+
+void InPlaceVerifier::trailer(size_t size) {
+	m_input += size;
+}
+
+void InPlaceVerifier::write(size_t size) {
+	m_output += size;
+	m_margin = std::max(m_margin, static_cast<int64_t>(m_output) - static_cast<int64_t>(m_input));
+}
+
+size_t InPlaceVerifier::minimumDisplacement() const {
+	return static_cast<size_t>(std::max<int64_t>(m_margin + static_cast<int64_t>(DecoderOverrun), 0));
+}
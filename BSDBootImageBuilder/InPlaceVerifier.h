@@ -0,0 +1,45 @@
+#ifndef IN_PLACE_VERIFIER__H
+#define IN_PLACE_VERIFIER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Simulates forward decompression of an LZ4 frame that is stored at some
+ * displacement D inside its own decompression destination, sequence by
+ * sequence, and computes the smallest D for which no byte of the frame is
+ * overwritten by the output before the decoder has read it. Every write is
+ * assumed to overrun its end by up to DecoderOverrun bytes, as optimized
+ * decoders copying in whole words do.
+ *
+ * The frame is passed either whole, to frame(), or piecewise as it is
+ * produced: the header, then every complete block, then the trailer.
+ */
+class InPlaceVerifier {
+public:
+	InPlaceVerifier();
+	~InPlaceVerifier();
+
+	void frame(const uint8_t *data, size_t size);
+
+	void header(size_t size);
+	void block(const uint8_t *data, size_t size);
+	void trailer(size_t size);
+
+	size_t minimumDisplacement() const;
+
+	inline size_t decodedSize() const {
+		return m_output;
+	}
+
+	static const size_t DecoderOverrun = 32;
+
+private:
+	void write(size_t size);
+
+	size_t m_input;
+	size_t m_output;
+	int64_t m_margin;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "InputFile.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+InputFile::InputFile(const std::string &fileName) : m_fileName(fileName), m_size(0), m_data(nullptr), m_mapped(true) {
+#ifdef _WIN32
+	m_mapping = nullptr;
+	m_file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		std::stringstream error;
+		error << "Cannot open " << fileName;
+		throw std::runtime_error(error.str());
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size)) {
+		CloseHandle(m_file);
+
+		std::stringstream error;
+		error << "Cannot determine size of " << fileName;
+		throw std::runtime_error(error.str());
+	}
+
+	m_size = static_cast<uint64_t>(size.QuadPart);
+
+	if (m_size != 0) {
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping)
+			m_data = static_cast<uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+
+		if (!m_data) {
+			if (m_mapping)
+				CloseHandle(m_mapping);
+			CloseHandle(m_file);
+
+			std::stringstream error;
+			error << "Cannot map " << fileName;
+			throw std::runtime_error(error.str());
+		}
+	}
+#else
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::stringstream error;
+		error << "Cannot open " << fileName;
+		throw std::runtime_error(error.str());
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+
+		std::stringstream error;
+		error << "Cannot determine size of " << fileName;
+		throw std::runtime_error(error.str());
+	}
+
+	m_size = static_cast<uint64_t>(st.st_size);
+
+	if (m_size != 0) {
+		void *data = mmap(nullptr, static_cast<size_t>(m_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+
+			std::stringstream error;
+			error << "Cannot map " << fileName;
+			throw std::runtime_error(error.str());
+		}
+
+		m_data = static_cast<uint8_t *>(data);
+	}
+
+	/*
+	 * The mapping stays valid after the descriptor is closed.
+	 */
+	close(fd);
+#endif
+}
+
+InputFile::InputFile(const std::string &fileName, const uint8_t *data, uint64_t size) :
+	m_fileName(fileName), m_size(size), m_data(const_cast<uint8_t *>(data)), m_mapped(false) {
+
+#ifdef _WIN32
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+#endif
+}
+
+InputFile::~InputFile() {
+	if (!m_mapped)
+		return;
+
+#ifdef _WIN32
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	CloseHandle(m_file);
+#else
+	if (m_data)
+		munmap(m_data, static_cast<size_t>(m_size));
+#endif
+}
+
+const uint8_t *InputFile::view(uint64_t offset, uint64_t size) const {
+	if (offset > m_size || size > m_size - offset) {
+		std::stringstream error;
+		error << m_fileName << ": range of " << size << " bytes at offset " << offset << " is outside of the file (" << m_size << " bytes)";
+		throw std::runtime_error(error.str());
+	}
+
+	return m_data + offset;
+}
+
+void InputFile::adviseSequential() const {
+#ifndef _WIN32
+	if (m_data && m_mapped)
+		madvise(m_data, static_cast<size_t>(m_size), MADV_SEQUENTIAL);
+#endif
+}
+
+void InputFile::adviseWillNeed(uint64_t offset, uint64_t size) const {
+#ifndef _WIN32
+	view(offset, size);
+
+	if (size == 0 || !m_mapped)
+		return;
+
+	uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	uint64_t start = offset & ~(pageSize - 1);
+
+	madvise(m_data + start, static_cast<size_t>(offset + size - start), MADV_WILLNEED);
+#else
+	(void)offset;
+	(void)size;
+#endif
+}
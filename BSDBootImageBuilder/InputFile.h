@@ -0,0 +1,75 @@
+#ifndef INPUT_FILE__H
+#define INPUT_FILE__H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Read-only input file mapped into memory. All accesses go through
+ * bounds-checked views, so truncated or malformed inputs are reported as
+ * errors instead of reading past the end of the mapping.
+ */
+class InputFile {
+public:
+	explicit InputFile(const std::string &fileName);
+
+	/*
+	 * Wraps size bytes of memory at data under the given name. The memory
+	 * is not copied, and must outlive the InputFile.
+	 */
+	InputFile(const std::string &fileName, const uint8_t *data, uint64_t size);
+	~InputFile();
+
+	InputFile(const InputFile &other) = delete;
+	InputFile &operator =(const InputFile &other) = delete;
+
+	inline const std::string &fileName() const {
+		return m_fileName;
+	}
+
+	inline uint64_t size() const {
+		return m_size;
+	}
+
+	/*
+	 * Returns a pointer to 'size' bytes of the file starting at 'offset'.
+	 * Throws if the range does not lie within the file.
+	 */
+	const uint8_t *view(uint64_t offset, uint64_t size) const;
+
+	template<typename T>
+	T read(uint64_t offset) const {
+		T value;
+		memcpy(&value, view(offset, sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	std::vector<T> readArray(uint64_t offset, size_t count) const {
+		std::vector<T> values(count);
+		if (count != 0)
+			memcpy(values.data(), view(offset, count * sizeof(T)), count * sizeof(T));
+		return values;
+	}
+
+	/*
+	 * Access pattern hints for the OS; ignored where not supported.
+	 */
+	void adviseSequential() const;
+	void adviseWillNeed(uint64_t offset, uint64_t size) const;
+
+private:
+	std::string m_fileName;
+	uint64_t m_size;
+	uint8_t *m_data;
+	bool m_mapped;
+#ifdef _WIN32
+	void *m_file;
+	void *m_mapping;
+#endif
+};
+
+#endif
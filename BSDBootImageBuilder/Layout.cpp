@@ -0,0 +1,136 @@
+#include "Layout.h"
+#include "Log.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+
+Layout::Layout() : imageBase(0), imageSize(0), kernelDelta(0) {
+
+}
+
+Layout::~Layout() {
+
+}
+
+void Layout::clear(uint32_t imageBase) {
+	this->imageBase = imageBase;
+	imageSize = 0;
+	kernelDelta = 0;
+	regions.clear();
+	extents.clear();
+}
+
+void Layout::addFileExtent(uint32_t address, const std::string &fileName, uint64_t fileOffset, uint32_t size) {
+	if (size == 0)
+		return;
+
+	extents.emplace_back();
+	auto &extent = extents.back();
+	extent.offset = address - imageBase;
+	extent.size = size;
+	extent.fileName = fileName;
+	extent.fileOffset = fileOffset;
+	extent.direct = false;
+}
+
+void Layout::addDataExtent(uint32_t address, const void *data, uint32_t size) {
+	if (size == 0)
+		return;
+
+	extents.emplace_back();
+	auto &extent = extents.back();
+	extent.offset = address - imageBase;
+	extent.size = size;
+	extent.fileOffset = 0;
+	extent.direct = false;
+	extent.data.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+}
+
+LayoutRegion &Layout::addRegion(LayoutRegionType type, const std::string &name, const std::string &fileName, uint32_t base, uint32_t size) {
+	regions.emplace_back();
+	auto &region = regions.back();
+	region.type = type;
+	region.name = name;
+	region.fileName = fileName;
+	region.base = base;
+	region.size = size;
+	region.symbolsStart = base;
+	region.symbolsEnd = base;
+	region.noCompress = false;
+
+	return region;
+}
+
+std::vector<size_t> Layout::regionBoundaries() const {
+	std::vector<size_t> boundaries;
+	boundaries.reserve(regions.size());
+
+	for (const auto &region : regions) {
+		boundaries.push_back(region.base - imageBase);
+	}
+
+	return boundaries;
+}
+
+uint64_t Layout::markDirectExtents(uint32_t minimumSize, uint32_t alignment) {
+	std::vector<LayoutExtent *> sorted;
+	sorted.reserve(extents.size());
+	for (auto &extent : extents) {
+		sorted.push_back(&extent);
+	}
+
+	std::sort(sorted.begin(), sorted.end(), [](const LayoutExtent *a, const LayoutExtent *b) {
+		return a->offset < b->offset;
+	});
+
+	uint64_t marked = 0;
+	size_t previousEnd = 0;
+
+	for (size_t index = 0; index < sorted.size(); index++) {
+		auto &extent = *sorted[index];
+		size_t end = extent.offset + extent.size;
+
+		bool overlapped = (index > 0 && previousEnd > extent.offset) ||
+			(index + 1 < sorted.size() && sorted[index + 1]->offset < end);
+
+		previousEnd = std::max(previousEnd, end);
+
+		if (extent.fileName.empty() || overlapped || extent.size < minimumSize ||
+			extent.offset % alignment != 0 || extent.fileOffset % alignment != 0)
+			continue;
+
+		extent.direct = true;
+		marked += extent.size;
+	}
+
+	return marked;
+}
+
+void Layout::print() const {
+	static const char *const typeNames[] = {
+		"module",
+		"dtb",
+		"environment",
+		"metadata"
+	};
+
+	logPrintf("Image layout: %08X - %08zX, %zu bytes\n", imageBase, imageBase + imageSize, imageSize);
+	logPrintf("  %-12s %-20s %-8s %-8s %-8s %-17s %s\n", "TYPE", "NAME", "PHYS", "VIRT", "SIZE", "SYMBOLS", "FILE");
+
+	for (const auto &region : regions) {
+		char symbols[18] = "-";
+		if (region.symbolsStart != region.symbolsEnd) {
+			snprintf(symbols, sizeof(symbols), "%08X-%08X", region.symbolsStart - kernelDelta, region.symbolsEnd - kernelDelta);
+		}
+
+		logPrintf("  %-12s %-20s %08X %08X %08X %-17s %s\n",
+			typeNames[static_cast<int>(region.type)],
+			region.name.c_str(),
+			region.base,
+			region.base - kernelDelta,
+			region.size,
+			symbols,
+			region.fileName.empty() ? "-" : region.fileName.c_str());
+	}
+}
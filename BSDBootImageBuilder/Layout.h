@@ -0,0 +1,79 @@
+#ifndef LAYOUT__H
+#define LAYOUT__H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A piece of the uncompressed image, either taken from a file or
+ * generated by the builder. Image bytes not covered by any extent are
+ * zero. Where extents overlap, the later one wins.
+ */
+struct LayoutExtent {
+	size_t offset; // Relative to the image base
+	uint32_t size;
+	std::string fileName; // Empty for generated data
+	uint64_t fileOffset;
+	std::vector<uint8_t> data;
+	bool direct; // Copied from the file straight into the output, never loaded into memory
+};
+
+enum class LayoutRegionType {
+	Module,
+	DTB,
+	Environment,
+	Metadata
+};
+
+/*
+ * A contiguous part of the image that belongs to one payload: a module
+ * (including its symbol tables), a DTB, an environment block or the
+ * kernel metadata.
+ */
+struct LayoutRegion {
+	LayoutRegionType type;
+	std::string name; // Module name; for DTBs and environments, name of the owning module
+	std::string fileName; // Empty for generated data
+	uint32_t base; // Physical address
+	uint32_t size;
+	uint32_t symbolsStart; // Physical address, equal to symbolsEnd if there are no symbols
+	uint32_t symbolsEnd;
+	bool noCompress; // Stored uncompressed in compressed images
+};
+
+/*
+ * Complete plan of the uncompressed image, computed from the blueprint,
+ * ELF headers and file sizes alone, before any payload is read.
+ */
+class Layout {
+public:
+	Layout();
+	~Layout();
+
+	void clear(uint32_t imageBase);
+
+	void addFileExtent(uint32_t address, const std::string &fileName, uint64_t fileOffset, uint32_t size);
+	void addDataExtent(uint32_t address, const void *data, uint32_t size);
+	LayoutRegion &addRegion(LayoutRegionType type, const std::string &name, const std::string &fileName, uint32_t base, uint32_t size);
+
+	std::vector<size_t> regionBoundaries() const;
+
+	/*
+	 * Marks file extents of at least minimumSize bytes, whose image and
+	 * file offsets are both multiples of alignment and which no other
+	 * extent overlaps, as direct. Returns the number of bytes marked.
+	 */
+	uint64_t markDirectExtents(uint32_t minimumSize, uint32_t alignment);
+
+	void print() const;
+
+	uint32_t imageBase;
+	size_t imageSize;
+	uint32_t kernelDelta;
+	std::vector<LayoutRegion> regions;
+	std::vector<LayoutExtent> extents;
+};
+
+#endif
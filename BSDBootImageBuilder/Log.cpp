@@ -0,0 +1,51 @@
+#include "Log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static thread_local std::string *capture = nullptr;
+
+void logPrintf(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	logVprintf(format, args);
+	va_end(args);
+}
+
+void logVprintf(const char *format, va_list args) {
+	if (!capture) {
+		vprintf(format, args);
+		return;
+	}
+
+	char buffer[512];
+	va_list retry;
+
+	va_copy(retry, args);
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+
+	if (length < 0) {
+		va_end(retry);
+		return;
+	}
+
+	if (static_cast<size_t>(length) < sizeof(buffer)) {
+		va_end(retry);
+		capture->append(buffer, length);
+		return;
+	}
+
+	std::string message(length + 1, '\0');
+	vsnprintf(&message[0], message.size(), format, retry);
+	va_end(retry);
+
+	capture->append(message, 0, length);
+}
+
+LogCapture::LogCapture() {
+	capture = &m_text;
+}
+
+LogCapture::~LogCapture() {
+	capture = nullptr;
+}
@@ -0,0 +1,41 @@
+#ifndef LOG__H
+#define LOG__H
+
+#include <string>
+#include <stdarg.h>
+
+#ifdef __GNUC__
+#define LOG_PRINTF_FORMAT __attribute__((format(printf, 1, 2)))
+#else
+#define LOG_PRINTF_FORMAT
+#endif
+
+/*
+ * Prints a progress message of a build. Messages go to stdout, unless the
+ * calling thread is capturing them (see LogCapture).
+ */
+void logPrintf(const char *format, ...) LOG_PRINTF_FORMAT;
+void logVprintf(const char *format, va_list args);
+
+/*
+ * Collects the progress messages printed by the current thread for as long
+ * as it exists, e.g. so that the messages of images built concurrently can
+ * be printed one image at a time. Captures do not nest.
+ */
+class LogCapture {
+public:
+	LogCapture();
+	~LogCapture();
+
+	LogCapture(const LogCapture &other) = delete;
+	LogCapture &operator =(const LogCapture &other) = delete;
+
+	inline const std::string &text() const {
+		return m_text;
+	}
+
+private:
+	std::string m_text;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include "ModuleDependencies.h"
+#include "Blueprint.h"
+#include "FileProvider.h"
+#include "FreeBSDTypes.h"
+#include "InputFile.h"
+#include "elf32.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+
+ModuleDependencies::ModuleDependencies(FileProvider &files) : m_files(files) {
+
+}
+
+ModuleDependencies::~ModuleDependencies() {
+
+}
+
+void ModuleDependencies::addModule(const Module &mod, bool elf) {
+	m_entries.emplace_back();
+	auto &entry = m_entries.back();
+	entry.module = &mod;
+
+	if (elf) {
+		auto file = m_files.open(mod.fileName);
+		readMetadata(*file, entry);
+	}
+}
+
+void ModuleDependencies::readMetadata(const InputFile &file, Entry &entry) {
+	auto ehdr = file.read<Elf32_Ehdr>(0);
+	auto phdr = file.readArray<Elf32_Phdr>(ehdr.e_phoff, ehdr.e_phnum);
+	auto shdr = file.readArray<Elf32_Shdr>(ehdr.e_shoff, ehdr.e_shnum);
+
+	if (ehdr.e_shstrndx >= shdr.size())
+		throw std::runtime_error(file.fileName() + ": bad section name table index");
+
+	auto &sectionNameSection = shdr[ehdr.e_shstrndx];
+	auto names = file.readArray<char>(sectionNameSection.sh_offset, sectionNameSection.sh_size);
+	names.push_back('\0');
+
+	/*
+	 * Pointers in the metadata are link-time virtual addresses, which
+	 * are mapped to the file through the PT_LOAD segments.
+	 */
+	auto fileOffset = [&](uint32_t address, uint32_t size) -> uint64_t {
+		for (const auto &segment : phdr) {
+			if (segment.p_type == PT_LOAD && address >= segment.p_vaddr &&
+				static_cast<uint64_t>(address) + size <= static_cast<uint64_t>(segment.p_vaddr) + segment.p_filesz)
+				return segment.p_offset + (address - segment.p_vaddr);
+		}
+
+		std::stringstream error;
+		error << file.fileName() << ": module metadata refers to address " << std::hex << address << ", which is not loaded from the file";
+		throw std::runtime_error(error.str());
+	};
+
+	auto readString = [&](uint32_t address) {
+		std::string string;
+
+		for (char character; (character = file.read<char>(fileOffset(address, 1))) != '\0'; address++) {
+			string.push_back(character);
+		}
+
+		return string;
+	};
+
+	for (const auto &section : shdr) {
+		if (section.sh_name >= names.size() || strcmp(names.data() + section.sh_name, "set_modmetadata_set") != 0)
+			continue;
+
+		auto pointers = file.readArray<uint32_t>(section.sh_offset, section.sh_size / sizeof(uint32_t));
+
+		for (auto pointer : pointers) {
+			auto metadata = file.read<mod_metadata32>(fileOffset(pointer, sizeof(mod_metadata32)));
+
+			if (metadata.md_type == MDT_VERSION) {
+				auto version = file.read<mod_version32>(fileOffset(metadata.md_data, sizeof(mod_version32)));
+				entry.provides.push_back(Version{ readString(metadata.md_cval), version.mv_version });
+			}
+			else if (metadata.md_type == MDT_DEPEND) {
+				auto depend = file.read<mod_depend32>(fileOffset(metadata.md_data, sizeof(mod_depend32)));
+				entry.depends.push_back(Dependency{ readString(metadata.md_cval), depend.md_ver_minimum, depend.md_ver_maximum });
+			}
+		}
+	}
+}
+
+std::vector<const Module *> ModuleDependencies::order() const {
+	/*
+	 * Edges go from every module to the modules providing its
+	 * dependencies. Dependencies provided by the module itself are
+	 * satisfied within the module, as they are by the kernel linker.
+	 */
+
+	std::vector<std::vector<size_t>> prerequisites(m_entries.size());
+
+	for (size_t index = 0; index < m_entries.size(); index++) {
+		const auto &entry = m_entries[index];
+
+		for (const auto &dependency : entry.depends) {
+			bool satisfied = false;
+			bool found = false;
+			std::stringstream versions;
+
+			for (size_t provider = 0; provider < m_entries.size() && !satisfied; provider++) {
+				for (const auto &version : m_entries[provider].provides) {
+					if (version.name != dependency.name)
+						continue;
+
+					found = true;
+					versions << " " << version.version << " (" << m_entries[provider].module->name << ")";
+
+					if (version.version >= dependency.minimum && version.version <= dependency.maximum) {
+						satisfied = true;
+
+						if (provider != index)
+							prerequisites[index].push_back(provider);
+
+						break;
+					}
+				}
+			}
+
+			if (!satisfied) {
+				std::stringstream error;
+				error << "Module " << entry.module->name << " depends on " << dependency.name
+					<< " version " << dependency.minimum << " to " << dependency.maximum;
+
+				if (found)
+					error << ", but only these versions are provided:" << versions.str();
+				else
+					error << ", which no module in the image provides";
+
+				throw std::runtime_error(error.str());
+			}
+		}
+	}
+
+	/*
+	 * Repeatedly take the first module, in blueprint order, whose
+	 * prerequisites have all been placed. The kernel has no dependencies
+	 * of its own and is always first in a valid blueprint, so it stays
+	 * first.
+	 */
+
+	std::vector<const Module *> order;
+	std::vector<bool> placed(m_entries.size(), false);
+
+	while (order.size() < m_entries.size()) {
+		size_t next = m_entries.size();
+
+		for (size_t index = 0; index < m_entries.size() && next == m_entries.size(); index++) {
+			if (placed[index])
+				continue;
+
+			bool ready = true;
+			for (auto prerequisite : prerequisites[index]) {
+				if (!placed[prerequisite]) {
+					ready = false;
+					break;
+				}
+			}
+
+			if (ready)
+				next = index;
+		}
+
+		if (next == m_entries.size()) {
+			std::stringstream error;
+			error << "Circular module dependencies between:";
+
+			for (size_t index = 0; index < m_entries.size(); index++) {
+				if (!placed[index])
+					error << " " << m_entries[index].module->name;
+			}
+
+			throw std::runtime_error(error.str());
+		}
+
+		placed[next] = true;
+		order.push_back(m_entries[next].module);
+	}
+
+	return order;
+}
@@ -0,0 +1,64 @@
+#ifndef MODULE_DEPENDENCIES__H
+#define MODULE_DEPENDENCIES__H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct Module;
+class FileProvider;
+class InputFile;
+
+/*
+ * Reads the MDT_VERSION and MDT_DEPEND records of the module metadata of
+ * the kernel and of ELF modules, checks that every dependency is provided,
+ * in a compatible version, by some module of the image, and orders the
+ * modules so that every module follows the modules it depends on.
+ */
+class ModuleDependencies {
+public:
+	explicit ModuleDependencies(FileProvider &files);
+	~ModuleDependencies();
+
+	ModuleDependencies(const ModuleDependencies &other) = delete;
+	ModuleDependencies &operator =(const ModuleDependencies &other) = delete;
+
+	/*
+	 * Modules are added in blueprint order. Metadata is only read from
+	 * ELF modules; other modules neither provide nor depend on anything.
+	 */
+	void addModule(const Module &mod, bool elf);
+
+	/*
+	 * Returns the modules in dependency order. The kernel stays first,
+	 * and modules otherwise keep their blueprint order as far as the
+	 * dependencies allow. Throws if a dependency cannot be satisfied or
+	 * the dependencies are circular.
+	 */
+	std::vector<const Module *> order() const;
+
+private:
+	struct Version {
+		std::string name;
+		int32_t version;
+	};
+
+	struct Dependency {
+		std::string name;
+		int32_t minimum;
+		int32_t maximum;
+	};
+
+	struct Entry {
+		const Module *module;
+		std::vector<Version> provides;
+		std::vector<Dependency> depends;
+	};
+
+	static void readMetadata(const InputFile &file, Entry &entry);
+
+	FileProvider &m_files;
+	std::vector<Entry> m_entries;
+};
+
+#endif
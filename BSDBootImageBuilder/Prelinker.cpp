@@ -0,0 +1,296 @@
+#include "Prelinker.h"
+#include "InputFile.h"
+#include "elf32.h"
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include <string.h>
+
+namespace {
+	/*
+	 * Maps module virtual addresses to file offsets through the PT_LOAD
+	 * segments. Addresses past the file size of a segment, but within its
+	 * memory size, read as zero.
+	 */
+	class ModuleView {
+	public:
+		ModuleView(const InputFile &file, const std::vector<Elf32_Phdr> &segments) : m_file(file), m_segments(segments) {
+
+		}
+
+		bool word(uint32_t address, uint32_t &value) const {
+			for (const auto &segment : m_segments) {
+				if (segment.p_type != PT_LOAD || address < segment.p_vaddr || address + 4 > segment.p_vaddr + segment.p_memsz)
+					continue;
+
+				uint32_t offset = address - segment.p_vaddr;
+
+				if (offset + 4 <= segment.p_filesz)
+					value = m_file.read<uint32_t>(segment.p_offset + offset);
+				else if (offset >= segment.p_filesz)
+					value = 0;
+				else
+					return false;
+
+				return true;
+			}
+
+			return false;
+		}
+
+		uint64_t fileOffset(uint32_t address, uint32_t size) const {
+			for (const auto &segment : m_segments) {
+				if (segment.p_type == PT_LOAD && address >= segment.p_vaddr &&
+					static_cast<uint64_t>(address) + size <= static_cast<uint64_t>(segment.p_vaddr) + segment.p_filesz)
+					return segment.p_offset + (address - segment.p_vaddr);
+			}
+
+			std::stringstream error;
+			error << m_file.fileName() << ": address " << std::hex << address << " is not loaded from the file";
+			throw std::runtime_error(error.str());
+		}
+
+	private:
+		const InputFile &m_file;
+		const std::vector<Elf32_Phdr> &m_segments;
+	};
+}
+
+Prelinker::Prelinker() {
+
+}
+
+Prelinker::~Prelinker() {
+
+}
+
+void Prelinker::addKernelSymbols(const InputFile &file, const std::vector<Elf32_Shdr> &sections) {
+	for (const auto &section : sections) {
+		if (section.sh_type != SHT_SYMTAB)
+			continue;
+
+		if (section.sh_entsize != sizeof(Elf32_Sym) || section.sh_link >= sections.size())
+			throw std::runtime_error(file.fileName() + ": bad symbol table");
+
+		const auto &stringSection = sections[section.sh_link];
+		auto symbols = file.readArray<Elf32_Sym>(section.sh_offset, section.sh_size / sizeof(Elf32_Sym));
+		auto names = reinterpret_cast<const char *>(file.view(stringSection.sh_offset, stringSection.sh_size));
+
+		for (const auto &symbol : symbols) {
+			auto bind = ELF32_ST_BIND(symbol.st_info);
+
+			if (symbol.st_shndx == SHN_UNDEF || (bind != STB_GLOBAL && bind != STB_WEAK) || symbol.st_name >= stringSection.sh_size)
+				continue;
+
+			std::string name(names + symbol.st_name, strnlen(names + symbol.st_name, stringSection.sh_size - symbol.st_name));
+
+			// Global definitions take precedence over weak ones
+			auto result = m_symbols.emplace(name, symbol.st_value);
+			if (!result.second && bind == STB_GLOBAL)
+				result.first->second = symbol.st_value;
+		}
+	}
+}
+
+bool Prelinker::prelink(const InputFile &file, const std::vector<Elf32_Phdr> &segments,
+	const std::vector<Elf32_Shdr> &sections, const std::vector<char> &sectionNames, uint32_t relocationBase,
+	std::vector<Patch> &patches, std::string &reason) const {
+
+	/*
+	 * The kernel linker moves the contents of these sets into per-CPU and
+	 * per-vnet storage and redirects every relocation that targets them,
+	 * which cannot be done ahead of time.
+	 */
+	static const char *const redirectedSections[] = { "set_pcpu", "set_vnet" };
+
+	for (const auto &section : sections) {
+		if (section.sh_name >= sectionNames.size())
+			continue;
+
+		for (auto name : redirectedSections) {
+			if (strcmp(sectionNames.data() + section.sh_name, name) == 0) {
+				reason = std::string("module has a ") + name + " section, which the kernel linker relocates at load time";
+				return false;
+			}
+		}
+	}
+
+	const Elf32_Phdr *dynamicSegment = nullptr;
+	for (const auto &segment : segments) {
+		if (segment.p_type == PT_DYNAMIC)
+			dynamicSegment = &segment;
+	}
+
+	if (!dynamicSegment) {
+		reason = "no dynamic section";
+		return false;
+	}
+
+	ModuleView view(file, segments);
+
+	auto dynamic = file.readArray<Elf32_Dyn>(dynamicSegment->p_offset, dynamicSegment->p_filesz / sizeof(Elf32_Dyn));
+
+	uint32_t symbolTable = 0;
+	uint32_t stringTable = 0;
+	uint32_t stringTableSize = 0;
+	uint32_t rel = 0, relSize = 0;
+	uint32_t rela = 0, relaSize = 0;
+	uint32_t pltRel = 0, pltRelSize = 0, pltRelType = DT_REL;
+	std::vector<size_t> relocationEntries;
+
+	for (size_t index = 0; index < dynamic.size() && dynamic[index].d_tag != DT_NULL; index++) {
+		const auto &entry = dynamic[index];
+
+		switch (entry.d_tag) {
+		case DT_SYMTAB: symbolTable = entry.d_val; break;
+		case DT_STRTAB: stringTable = entry.d_val; break;
+		case DT_STRSZ: stringTableSize = entry.d_val; break;
+		case DT_REL: rel = entry.d_val; break;
+		case DT_RELSZ: relSize = entry.d_val; break;
+		case DT_RELA: rela = entry.d_val; break;
+		case DT_RELASZ: relaSize = entry.d_val; break;
+		case DT_JMPREL: pltRel = entry.d_val; break;
+		case DT_PLTRELSZ: pltRelSize = entry.d_val; break;
+		case DT_PLTREL: pltRelType = entry.d_val; break;
+		}
+
+		switch (entry.d_tag) {
+		case DT_REL:
+		case DT_RELSZ:
+		case DT_RELENT:
+		case DT_RELA:
+		case DT_RELASZ:
+		case DT_RELAENT:
+		case DT_JMPREL:
+		case DT_PLTRELSZ:
+		case DT_PLTREL:
+		case DT_TEXTREL:
+			relocationEntries.push_back(index);
+			break;
+		}
+	}
+
+	/*
+	 * Relocations are applied in order to a copy of the words they touch,
+	 * so that a word relocated more than once accumulates all of them.
+	 */
+	std::map<uint32_t, uint32_t> words;
+
+	auto resolve = [&](uint32_t symbolIndex, uint32_t &value) {
+		auto symbol = file.read<Elf32_Sym>(view.fileOffset(symbolTable + symbolIndex * sizeof(Elf32_Sym), sizeof(Elf32_Sym)));
+
+		if (symbol.st_shndx != SHN_UNDEF) {
+			value = symbol.st_value + relocationBase;
+			return true;
+		}
+
+		if (symbol.st_name >= stringTableSize) {
+			reason = "bad symbol name";
+			return false;
+		}
+
+		auto names = reinterpret_cast<const char *>(file.view(view.fileOffset(stringTable, stringTableSize), stringTableSize));
+		std::string name(names + symbol.st_name, strnlen(names + symbol.st_name, stringTableSize - symbol.st_name));
+
+		auto it = m_symbols.find(name);
+		if (it != m_symbols.end()) {
+			value = it->second;
+			return true;
+		}
+
+		if (ELF32_ST_BIND(symbol.st_info) == STB_WEAK) {
+			value = 0;
+			return true;
+		}
+
+		reason = "symbol '" + name + "' is not defined by the kernel";
+		return false;
+	};
+
+	auto apply = [&](uint32_t address, uint32_t info, bool hasAddend, int32_t addend) {
+		uint32_t type = ELF32_R_TYPE(info);
+		if (type == R_ARM_NONE)
+			return true;
+
+		auto it = words.find(address);
+		if (it == words.end()) {
+			uint32_t original;
+			if (!view.word(address, original)) {
+				reason = "relocation target is outside of the loaded segments";
+				return false;
+			}
+
+			it = words.emplace(address, original).first;
+		}
+
+		uint32_t &word = it->second;
+		uint32_t value = 0;
+
+		if (type != R_ARM_RELATIVE && !resolve(ELF32_R_SYM(info), value))
+			return false;
+
+		switch (type) {
+		case R_ARM_RELATIVE:
+			word = (hasAddend ? addend : word) + relocationBase;
+			break;
+
+		case R_ARM_ABS32:
+			word = (hasAddend ? addend : word) + value;
+			break;
+
+		case R_ARM_GLOB_DAT:
+		case R_ARM_JUMP_SLOT:
+			word = value + (hasAddend ? addend : 0);
+			break;
+
+		default:
+		{
+			std::stringstream error;
+			error << "unsupported relocation type " << type;
+			reason = error.str();
+			return false;
+		}
+		}
+
+		return true;
+	};
+
+	auto applyRel = [&](uint32_t table, uint32_t size) {
+		for (uint32_t offset = 0; offset + sizeof(Elf32_Rel) <= size; offset += sizeof(Elf32_Rel)) {
+			auto relocation = file.read<Elf32_Rel>(view.fileOffset(table + offset, sizeof(Elf32_Rel)));
+			if (!apply(relocation.r_offset, relocation.r_info, false, 0))
+				return false;
+		}
+
+		return true;
+	};
+
+	auto applyRela = [&](uint32_t table, uint32_t size) {
+		for (uint32_t offset = 0; offset + sizeof(Elf32_Rela) <= size; offset += sizeof(Elf32_Rela)) {
+			auto relocation = file.read<Elf32_Rela>(view.fileOffset(table + offset, sizeof(Elf32_Rela)));
+			if (!apply(relocation.r_offset, relocation.r_info, true, relocation.r_addend))
+				return false;
+		}
+
+		return true;
+	};
+
+	if ((relSize != 0 && !applyRel(rel, relSize)) ||
+		(relaSize != 0 && !applyRela(rela, relaSize)) ||
+		(pltRelSize != 0 && !(pltRelType == DT_RELA ? applyRela(pltRel, pltRelSize) : applyRel(pltRel, pltRelSize))))
+		return false;
+
+	patches.clear();
+
+	for (const auto &word : words) {
+		patches.push_back(Patch{ word.first, word.second });
+	}
+
+	for (auto index : relocationEntries) {
+		patches.push_back(Patch{ dynamicSegment->p_vaddr + static_cast<uint32_t>(index * sizeof(Elf32_Dyn)), static_cast<uint32_t>(DT_GNU_PRELINKED) });
+	}
+
+	return true;
+}
@@ -0,0 +1,65 @@
+#ifndef PRELINKER__H
+#define PRELINKER__H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+struct Elf32_Phdr;
+struct Elf32_Shdr;
+class InputFile;
+
+/*
+ * Applies the dynamic relocations of ELF kernel modules at build time, for
+ * the virtual address the module is placed at, resolving undefined symbols
+ * against the kernel symbol table.
+ *
+ * The relocation entries of the dynamic section of a prelinked module are
+ * retagged as DT_GNU_PRELINKED, which the kernel linker ignores, so that it
+ * finds nothing left to relocate at boot; the tag also marks the module as
+ * prelinked for anyone inspecting the image.
+ */
+class Prelinker {
+public:
+	Prelinker();
+	~Prelinker();
+
+	Prelinker(const Prelinker &other) = delete;
+	Prelinker &operator =(const Prelinker &other) = delete;
+
+	/*
+	 * A word of the module to be replaced, at a virtual address relative
+	 * to the module link address (0 for kernel modules).
+	 */
+	struct Patch {
+		uint32_t address;
+		uint32_t value;
+	};
+
+	/*
+	 * Adds the defined global and weak symbols of the kernel symbol table.
+	 */
+	void addKernelSymbols(const InputFile &file, const std::vector<Elf32_Shdr> &sections);
+
+	/*
+	 * Computes the patches that relocate the module for relocationBase.
+	 * Returns false, with the reason set, if the module cannot be
+	 * prelinked, e.g. because it refers to symbols of other modules or has
+	 * per-CPU or vnet data, whose relocations the kernel linker redirects to
+	 * copies it allocates at load time; such modules are left to the kernel
+	 * linker.
+	 */
+	bool prelink(const InputFile &file, const std::vector<Elf32_Phdr> &segments,
+		const std::vector<Elf32_Shdr> &sections, const std::vector<char> &sectionNames, uint32_t relocationBase,
+		std::vector<Patch> &patches, std::string &reason) const;
+
+	inline size_t kernelSymbols() const {
+		return m_symbols.size();
+	}
+
+private:
+	std::unordered_map<std::string, uint32_t> m_symbols;
+};
+
+#endif
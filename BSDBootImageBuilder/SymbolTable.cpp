@@ -0,0 +1,120 @@
+#include "SymbolTable.h"
+#include "InputFile.h"
+#include "elf32.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <string.h>
+
+static bool isDebugSymbol(const Elf32_Sym &symbol, const char *name) {
+	auto type = ELF32_ST_TYPE(symbol.st_info);
+
+	if (type == STT_FILE || type == STT_SECTION)
+		return true;
+
+	if (ELF32_ST_BIND(symbol.st_info) != STB_LOCAL || type != STT_NOTYPE)
+		return false;
+
+	/*
+	 * ARM mapping symbols ($a, $t, $d, optionally followed by a dot and
+	 * anything) and assembler local labels.
+	 */
+	if (name[0] == '$' && (name[1] == 'a' || name[1] == 't' || name[1] == 'd') && (name[2] == '\0' || name[2] == '.'))
+		return true;
+
+	return strncmp(name, ".L", 2) == 0;
+}
+
+static bool keepSymbol(const Elf32_Sym &symbol, const char *name, SymbolFilter filter) {
+	switch (filter) {
+	case SymbolFilter::All:
+		return true;
+
+	case SymbolFilter::NoDebug:
+		return !isDebugSymbol(symbol, name);
+
+	case SymbolFilter::Global:
+		return ELF32_ST_BIND(symbol.st_info) != STB_LOCAL || ELF32_ST_TYPE(symbol.st_info) == STT_FUNC;
+	}
+
+	return true;
+}
+
+void compactSymbolTable(const InputFile &file, const Elf32_Shdr &symbolSection, const Elf32_Shdr &stringSection,
+	SymbolFilter filter, std::vector<uint8_t> &symbols, std::vector<uint8_t> &strings) {
+
+	if (symbolSection.sh_entsize != sizeof(Elf32_Sym) || symbolSection.sh_size % sizeof(Elf32_Sym) != 0)
+		throw std::runtime_error(file.fileName() + ": bad symbol table entry size");
+
+	auto input = file.readArray<Elf32_Sym>(symbolSection.sh_offset, symbolSection.sh_size / sizeof(Elf32_Sym));
+	auto names = reinterpret_cast<const char *>(file.view(stringSection.sh_offset, stringSection.sh_size));
+
+	std::vector<Elf32_Sym> kept;
+	std::vector<std::string> keptNames;
+
+	for (size_t index = 0; index < input.size(); index++) {
+		const auto &symbol = input[index];
+
+		if (symbol.st_name >= stringSection.sh_size)
+			throw std::runtime_error(file.fileName() + ": symbol name is outside of the string table");
+
+		const char *name = names + symbol.st_name;
+		std::string nameString(name, strnlen(name, stringSection.sh_size - symbol.st_name));
+
+		if (index == 0 || keepSymbol(symbol, nameString.c_str(), filter)) {
+			kept.push_back(symbol);
+			keptNames.push_back(std::move(nameString));
+		}
+	}
+
+	/*
+	 * Names are placed in the order of their reversed text, longest first
+	 * among those sharing an ending, so that a name that is a suffix of
+	 * another directly follows it and can point into it.
+	 */
+
+	std::vector<const std::string *> unique;
+	{
+		std::unordered_map<std::string, bool> seen;
+		for (const auto &name : keptNames) {
+			if (!name.empty() && seen.emplace(name, true).second)
+				unique.push_back(&name);
+		}
+	}
+
+	std::sort(unique.begin(), unique.end(), [](const std::string *a, const std::string *b) {
+		return std::lexicographical_compare(b->rbegin(), b->rend(), a->rbegin(), a->rend());
+	});
+
+	std::unordered_map<std::string, uint32_t> offsets;
+	const std::string *previous = nullptr;
+	uint32_t previousOffset = 0;
+
+	strings.assign(1, 0); // Empty name at offset 0
+
+	for (auto name : unique) {
+		if (previous && previous->size() >= name->size() &&
+			previous->compare(previous->size() - name->size(), name->size(), *name) == 0) {
+
+			offsets[*name] = previousOffset + static_cast<uint32_t>(previous->size() - name->size());
+			continue;
+		}
+
+		previous = name;
+		previousOffset = static_cast<uint32_t>(strings.size());
+		offsets[*name] = previousOffset;
+
+		strings.insert(strings.end(), name->begin(), name->end());
+		strings.push_back(0);
+	}
+
+	for (size_t index = 0; index < kept.size(); index++) {
+		kept[index].st_name = keptNames[index].empty() ? 0 : offsets[keptNames[index]];
+	}
+
+	symbols.resize(kept.size() * sizeof(Elf32_Sym));
+	memcpy(symbols.data(), kept.data(), symbols.size());
+}
@@ -0,0 +1,26 @@
+#ifndef SYMBOL_TABLE__H
+#define SYMBOL_TABLE__H
+
+#include <vector>
+#include <stdint.h>
+
+#include "Blueprint.h"
+
+struct Elf32_Shdr;
+class InputFile;
+
+/*
+ * Rebuilds an ELF symbol table and its string table, keeping only the
+ * symbols that pass the filter. The null symbol is always kept. The new
+ * string table holds every name once, with names that are a suffix of
+ * another name sharing its storage, and st_name of every kept symbol is
+ * rewritten to match.
+ *
+ * Symbol indices change, so this is only suitable for the symbol tables
+ * that are loaded for the kernel linker lookups and the debugger, not for
+ * those referred to by relocations.
+ */
+void compactSymbolTable(const InputFile &file, const Elf32_Shdr &symbolSection, const Elf32_Shdr &stringSection,
+	SymbolFilter filter, std::vector<uint8_t> &symbols, std::vector<uint8_t> &strings);
+
+#endif
@@ -0,0 +1,75 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+WorkerPool::WorkerPool(unsigned int jobs) : m_jobs(jobs == 0 ? defaultJobs() : jobs) {
+
+}
+
+WorkerPool::~WorkerPool() {
+
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t item, unsigned int worker)> &body) {
+	if (m_jobs <= 1 || count <= 1) {
+		for (size_t item = 0; item < count; item++) {
+			body(item, 0);
+		}
+
+		return;
+	}
+
+	std::atomic<size_t> nextItem(0);
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	auto worker = [&](unsigned int workerIndex) {
+		while (!failed.load(std::memory_order_relaxed)) {
+			size_t item = nextItem.fetch_add(1);
+			if (item >= count)
+				break;
+
+			try {
+				body(item, workerIndex);
+			}
+			catch (...) {
+				std::unique_lock<std::mutex> lock(errorMutex);
+				if (!error)
+					error = std::current_exception();
+
+				failed.store(true);
+			}
+		}
+	};
+
+	unsigned int threadCount = static_cast<unsigned int>(std::min<size_t>(m_jobs, count));
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount - 1);
+
+	for (unsigned int index = 1; index < threadCount; index++) {
+		threads.emplace_back(worker, index);
+	}
+
+	worker(0);
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+unsigned int WorkerPool::defaultJobs() {
+	unsigned int jobs = std::thread::hardware_concurrency();
+	if (jobs == 0)
+		jobs = 1;
+
+	return jobs;
+}
@@ -0,0 +1,34 @@
+#ifndef WORKER_POOL__H
+#define WORKER_POOL__H
+
+#include <functional>
+#include <stddef.h>
+
+class WorkerPool {
+public:
+	explicit WorkerPool(unsigned int jobs);
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool &other) = delete;
+	WorkerPool &operator =(const WorkerPool &other) = delete;
+
+	inline unsigned int jobs() const {
+		return m_jobs;
+	}
+
+	/*
+	 * Invokes body(item, worker) for every item in [0, count). Items are
+	 * handed out to the workers in increasing order; worker is in [0, jobs())
+	 * and may be used to index per-worker state. The first exception thrown
+	 * by the body stops distribution of further items and is rethrown once
+	 * all workers have finished.
+	 */
+	void run(size_t count, const std::function<void(size_t item, unsigned int worker)> &body);
+
+	static unsigned int defaultJobs();
+
+private:
+	unsigned int m_jobs;
+};
+
+#endif
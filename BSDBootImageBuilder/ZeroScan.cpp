@@ -0,0 +1,55 @@
+#include "ZeroScan.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZERO_SCAN_SSE2
+#endif
+
+bool isZero(const uint8_t *data, size_t size) {
+	size_t position = 0;
+
+#ifdef ZERO_SCAN_SSE2
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; position + 64 <= size; position += 64) {
+		__m128i accumulator = _mm_or_si128(
+			_mm_or_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position + 16))),
+			_mm_or_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position + 32)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position + 48))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(accumulator, zero)) != 0xFFFF)
+			return false;
+	}
+#endif
+
+	for (; position + sizeof(uint64_t) <= size; position += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + position, sizeof(word));
+		if (word != 0)
+			return false;
+	}
+
+	for (; position < size; position++) {
+		if (data[position] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+size_t trimZeros(const uint8_t *data, size_t size) {
+	while (size >= 64 && isZero(data + size - 64, 64)) {
+		size -= 64;
+	}
+
+	while (size > 0 && data[size - 1] == 0) {
+		size--;
+	}
+
+	return size;
+}
@@ -0,0 +1,18 @@
+#ifndef ZERO_SCAN__H
+#define ZERO_SCAN__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns true if all size bytes at data are zero.
+ */
+bool isZero(const uint8_t *data, size_t size);
+
+/*
+ * Returns the length of data with trailing zero bytes removed, i.e. the
+ * offset just past the last non-zero byte, or 0 if all bytes are zero.
+ */
+size_t trimZeros(const uint8_t *data, size_t size);
+
+#endif
@@ -73,9 +73,39 @@ typedef uint32_t Elf32_Word;
 #define SHT_SHLIB		10
 #define SHT_DYNSYM		11
 
+#define SHN_UNDEF		0
+
+#define SHF_WRITE		0x1
+#define SHF_ALLOC		0x2
+#define SHF_EXECINSTR	0x4
+
+#define DT_NULL			0
+#define DT_NEEDED		1
+#define DT_PLTRELSZ		2
+#define DT_PLTGOT		3
+#define DT_HASH			4
+#define DT_STRTAB		5
+#define DT_SYMTAB		6
+#define DT_RELA			7
+#define DT_RELASZ		8
+#define DT_RELAENT		9
+#define DT_STRSZ		10
+#define DT_SYMENT		11
+#define DT_REL			17
+#define DT_RELSZ		18
+#define DT_RELENT		19
+#define DT_PLTREL		20
+#define DT_TEXTREL		22
+#define DT_JMPREL		23
+#define DT_GNU_PRELINKED	0x6ffffdf5
+
+#define R_ARM_NONE			0
 #define R_ARM_ABS32			2
 #define R_ARM_REL32			3
 #define R_ARM_THM_CALL		10
+#define R_ARM_GLOB_DAT		21
+#define R_ARM_JUMP_SLOT		22
+#define R_ARM_RELATIVE		23
 #define R_ARM_CALL			28
 #define R_ARM_JUMP24		29
 #define R_ARM_THM_JUMP24	30
@@ -124,6 +154,11 @@ struct Elf32_Shdr {
 	Elf32_Word	sh_entsize;
 };
 
+typedef struct {
+	Elf32_Sword	d_tag;
+	Elf32_Word	d_val;
+} Elf32_Dyn;
+
 typedef struct {
 	Elf32_Addr	r_offset;
 	Elf32_Word	r_info;
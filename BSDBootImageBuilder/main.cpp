@@ -1,39 +1,528 @@
 #include <stdio.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "BlockCache.h"
 #include "Blueprint.h"
+#include "BootEmulator.h"
+#include "BuildCache.h"
+#include "BuildOptions.h"
+#include "FileProvider.h"
+#include "FileWatcher.h"
 #include "Image.h"
+#include "Log.h"
+#include "WorkerPool.h"
 
-int main(int argc, char *argv[]) {
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <OUTPUT FILE> <BLUEPRINT FILE>\n", argv[0]);
+static void usage(const char *program) {
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] <OUTPUT FILE> <BLUEPRINT FILE>\n"
+		"       %s [OPTIONS] --batch <LIST FILE>\n"
+		"Options:\n"
+		"  -D, --define <N=V>  Define blueprint variable N as V, overriding DEFINE in the blueprint\n"
+		"  -j, --jobs <N>      Use N worker threads (default: one per hardware thread)\n"
+		"  --cache <DIR>       Reuse output images built from identical inputs, kept in DIR\n"
+		"  --block-cache <DIR> Reuse compressed frame blocks with identical contents, kept in DIR\n"
+		"  --max-memory <SIZE> Stream the image to the output file, holding at most about SIZE\n"
+		"                      bytes of it in memory (K, M and G suffixes are accepted)\n"
+		"  -n, --dry-run       Only plan and print the image layout, do not write any output\n"
+		"  --verify            Boot the output image on the host and check it against the layout\n"
+		"  --boot-report       Print an estimate of the boot time of the output image\n"
+		"  --boot-profile <P>  Target speeds for --boot-report, e.g. flash=20M,memory=300M,lz4=100M\n"
+		"                      (bytes per second; implies --boot-report)\n"
+		"  --batch <LIST>      Build every image listed in LIST, one \"<OUTPUT FILE> <BLUEPRINT FILE>\"\n"
+		"                      per line, optionally followed by -DN=V definitions, in parallel\n"
+		"                      and reading every input file once\n"
+		"  --watch             Stay resident, and rebuild the output image whenever the blueprint\n"
+		"                      or any file referenced by it changes (Linux only)\n",
+		program, program);
+}
+
+static size_t parseSize(const std::string &value) {
+	size_t suffix;
+	unsigned long long size = std::stoull(value, &suffix, 0);
+
+	if (suffix < value.size()) {
+		auto unit = value.substr(suffix);
+
+		if (unit == "K" || unit == "k")
+			size <<= 10;
+		else if (unit == "M" || unit == "m")
+			size <<= 20;
+		else if (unit == "G" || unit == "g")
+			size <<= 30;
+		else
+			throw std::runtime_error("Invalid size suffix: " + unit);
+	}
+
+	return static_cast<size_t>(size);
+}
+
+typedef std::vector<std::pair<std::string, std::string>> Definitions;
+
+static void parseDefinition(const std::string &definition, Definitions &definitions) {
+	auto separator = definition.find('=');
+	if (separator == 0 || separator == std::string::npos)
+		throw std::runtime_error("Definition expected as name=value: " + definition);
+
+	definitions.emplace_back(definition.substr(0, separator), definition.substr(separator + 1));
+}
+
+/*
+ * Matches argv[index] against a short and a long option name, and, if it
+ * matches, extracts the option value. Values may be given either as a
+ * separate argument ("-j 4", "--jobs 4") or attached ("-j4", "--jobs=4").
+ */
+static bool matchOption(int argc, char *argv[], int &index, const char *shortName, const char *longName, std::string &value) {
+	const char *arg = argv[index];
+	const char *attached = nullptr;
+
+	size_t shortLength = shortName ? strlen(shortName) : 0;
+	size_t longLength = strlen(longName);
+
+	if (shortName && strncmp(arg, shortName, shortLength) == 0) {
+		attached = arg + shortLength;
+	}
+	else if (strncmp(arg, longName, longLength) == 0 && (arg[longLength] == '\0' || arg[longLength] == '=')) {
+		attached = arg[longLength] == '=' ? arg + longLength + 1 : arg + longLength;
+	}
+	else {
+		return false;
+	}
+
+	if (*attached != '\0') {
+		value = attached;
+	}
+	else {
+		if (index + 1 >= argc)
+			throw std::runtime_error(std::string("Option ") + arg + " requires a value");
+
+		value = argv[++index];
+	}
+
+	return true;
+}
+
+static void reportError(const std::string &prefix, const char *what, const std::exception &e) {
+	fflush(stdout);
+	fprintf(stderr, "%s%s: %s\n", prefix.c_str(), what, e.what());
+	fflush(stderr);
+}
+
+static int verify(const std::string &outputFile, const Image &image, const BuildOptions &options, FileProvider &files,
+	const std::string &prefix) {
+	try {
+		WorkerPool pool(options.jobs);
+		BootEmulator emulator(outputFile, image.layout(), files);
+
+		return emulator.run(pool) ? 0 : 1;
+	}
+	catch (const std::exception &e) {
+		reportError(prefix, "Verification of output image failed", e);
 		return 1;
 	}
+}
+
+/*
+ * Builds one output image. Errors are prefixed with prefix, which is used
+ * to tell the images of a batch apart (progress messages are prefixed by
+ * the batch itself). A block cache, if given, is used
+ * instead of the block cache directory of the options.
+ */
+static int buildImage(const std::string &outputFile, const std::string &blueprintFile, const Definitions &definitions,
+	BuildOptions options, FileProvider &files, BlockCache *blockCache, const std::string &prefix) {
 
 	Blueprint blueprint;
 	try {
-		blueprint.parse(argv[2]);
+		for (const auto &definition : definitions) {
+			blueprint.define(definition.first, definition.second);
+		}
+
+		blueprint.parse(blueprintFile);
 	}
 	catch (const std::exception &e) {
-		fflush(stdout);
-		fprintf(stderr, "Parsing of blueprint file failed: %s\n", e.what());
-		fflush(stderr);
+		reportError(prefix, "Parsing of blueprint file failed", e);
 		return 1;
 	}
 
+	std::unique_ptr<BuildCache> cache;
+	std::string cacheKey;
+	bool cached = false;
+
+	/*
+	 * The boot report is computed from the build itself, so an image from
+	 * the cache cannot be reported on.
+	 */
+	if (!options.cacheDirectory.empty() && !options.dryRun && !options.bootReport) {
+		try {
+			cache.reset(new BuildCache(options.cacheDirectory));
+			cacheKey = cache->key(blueprint, options, files);
+
+			if (cache->fetch(cacheKey, outputFile)) {
+				logPrintf("Output image %s taken from build cache\n", cacheKey.c_str());
+
+				if (!options.verify)
+					return 0;
+
+				/*
+				 * Verification needs the layout, which is planned
+				 * without loading any payload.
+				 */
+				cache.reset();
+				options.dryRun = true;
+				cached = true;
+			}
+		}
+		catch (const std::exception &e) {
+			reportError(prefix, "Build cache lookup failed", e);
+			return 1;
+		}
+	}
+
 	Image image;
+	image.setFileProvider(files);
+	image.setBlockCache(blockCache);
+
 	try {
-		image.build(blueprint);
+		image.build(blueprint, options);
 	}
 	catch (const std::exception &e) {
-		fflush(stdout);
-		fprintf(stderr, "Image building failed: %s\n", e.what());
-		fflush(stderr);
+		reportError(prefix, "Image building failed", e);
 		return 1;
 	}
 
-	image.writeElf(argv[1]);
+	if (cached)
+		return verify(outputFile, image, options, files, prefix);
+
+	if (options.dryRun)
+		return 0;
+
+	try {
+		image.writeElf(outputFile);
+	}
+	catch (const std::exception &e) {
+		reportError(prefix, "Writing of output image failed", e);
+		return 1;
+	}
+
+	if (options.bootReport)
+		image.printBootReport();
+
+	if (cache) {
+		try {
+			cache->store(cacheKey, outputFile);
+			logPrintf("Output image %s stored in build cache\n", cacheKey.c_str());
+		}
+		catch (const std::exception &e) {
+			reportError(prefix, "Failed to store output image in build cache", e);
+		}
+	}
+
+	if (options.verify)
+		return verify(outputFile, image, options, files, prefix);
 
 	return 0;
 }
+
+struct BatchEntry {
+	std::string outputFile;
+	std::string blueprintFile;
+	Definitions definitions; // Added to those from the command line
+};
+
+/*
+ * Reads a batch list: one output file and blueprint file pair per line,
+ * each optionally followed by -Dname=value variable definitions. Empty
+ * lines and lines starting with ';' are ignored.
+ */
+static std::vector<BatchEntry> readBatchList(const std::string &filename) {
+	std::ifstream stream;
+	stream.exceptions(std::ios::badbit);
+	stream.open(filename, std::ios::in);
+	if (!stream)
+		throw std::runtime_error("Cannot open " + filename);
+
+	std::vector<BatchEntry> entries;
+	std::string line;
+	unsigned int lineNumber = 0;
+
+	while (std::getline(stream, line)) {
+		lineNumber++;
+
+		std::stringstream tokens(line);
+		BatchEntry entry;
+		std::string definition;
+
+		if (!(tokens >> entry.outputFile) || entry.outputFile[0] == ';')
+			continue;
+
+		if (!(tokens >> entry.blueprintFile)) {
+			std::stringstream error;
+			error << filename << ":" << lineNumber << ": expected an output file and a blueprint file";
+			throw std::runtime_error(error.str());
+		}
+
+		while (tokens >> definition) {
+			if (definition.compare(0, 2, "-D") != 0) {
+				std::stringstream error;
+				error << filename << ":" << lineNumber << ": expected -Dname=value, got '" << definition << "'";
+				throw std::runtime_error(error.str());
+			}
+
+			parseDefinition(definition.substr(2), entry.definitions);
+		}
+
+		entries.push_back(entry);
+	}
+
+	return entries;
+}
+
+/*
+ * Builds every image of a batch. All builds share one SharedFileProvider,
+ * so that input files common to several images (typically the kernel and
+ * modules, with only DTBs and metadata differing between board variants)
+ * are opened, mapped and read from disk once. Images are built
+ * concurrently, with the worker threads divided between them. The progress
+ * messages of every image are collected while it is built, and printed
+ * together, with every line prefixed by the output file name, once it is
+ * done.
+ */
+static int buildBatch(const std::string &listFile, const Definitions &definitions, const BuildOptions &options) {
+	std::vector<BatchEntry> entries;
+
+	try {
+		entries = readBatchList(listFile);
+	}
+	catch (const std::exception &e) {
+		reportError(std::string(), "Reading of batch list failed", e);
+		return 1;
+	}
+
+	if (entries.empty())
+		return 0;
+
+	WorkerPool pool(options.jobs);
+	unsigned int concurrentImages = static_cast<unsigned int>(std::min<size_t>(pool.jobs(), entries.size()));
+
+	BuildOptions imageOptions = options;
+	imageOptions.jobs = std::max(1U, pool.jobs() / concurrentImages);
+
+	SharedFileProvider files;
+	std::atomic<size_t> failed(0);
+	std::mutex outputMutex;
+
+	WorkerPool images(concurrentImages);
+	images.run(entries.size(), [&](size_t item, unsigned int worker) {
+		(void)worker;
+
+		const auto &entry = entries[item];
+
+		Definitions imageDefinitions = definitions;
+		imageDefinitions.insert(imageDefinitions.end(), entry.definitions.begin(), entry.definitions.end());
+
+		auto prefix = entry.outputFile + ": ";
+		int result;
+		std::string output;
+
+		{
+			LogCapture capture;
+			result = buildImage(entry.outputFile, entry.blueprintFile, imageDefinitions, imageOptions, files, nullptr, prefix);
+			output = capture.text();
+		}
+
+		if (result != 0)
+			failed++;
+
+		std::string prefixed;
+		for (size_t start = 0; start < output.size(); ) {
+			size_t end = output.find('\n', start);
+			end = end == std::string::npos ? output.size() : end + 1;
+
+			prefixed += prefix;
+			prefixed.append(output, start, end - start);
+			start = end;
+		}
+
+		std::unique_lock<std::mutex> lock(outputMutex);
+		fputs(prefixed.c_str(), stdout);
+		fflush(stdout);
+	});
+
+	printf("Batch: %zu of %zu images built, %zu input files opened %zu times\n", entries.size() - failed, entries.size(),
+		files.fileCount(), files.openCount());
+
+	return failed == 0 ? 0 : 1;
+}
+
+/*
+ * Builds the image, then keeps rebuilding it whenever the blueprint, a file
+ * included by it or any input file changes, until interrupted. Input files
+ * stay mapped between builds and are only opened again once they change,
+ * and compressed blocks are kept in memory, so that a rebuild after a
+ * change to one module only compresses the blocks that changed (see
+ * COMPRESS MODULE_BLOCKS).
+ */
+static int watchImage(const std::string &outputFile, const std::string &blueprintFile, const Definitions &definitions,
+	const BuildOptions &options) {
+
+	std::unique_ptr<FileWatcher> watcher;
+	try {
+		watcher.reset(new FileWatcher());
+	}
+	catch (const std::exception &e) {
+		reportError(std::string(), "Cannot watch for changes", e);
+		return 1;
+	}
+
+	SharedFileProvider files;
+	std::unique_ptr<BlockCache> blockCache;
+
+	if (options.blockCacheDirectory.empty())
+		blockCache.reset(new BlockCache());
+
+	while (true) {
+		/*
+		 * The blueprint is parsed for the list of files to watch, which
+		 * are watched before the image is built, so that changes made
+		 * while it is being built trigger another build. If it cannot be
+		 * parsed, the blueprint files read so far are watched.
+		 */
+		Blueprint blueprint;
+		std::vector<std::string> watched;
+
+		try {
+			for (const auto &definition : definitions) {
+				blueprint.define(definition.first, definition.second);
+			}
+
+			blueprint.parse(blueprintFile);
+			watched = blueprint.inputFiles();
+		}
+		catch (const std::exception &) {
+
+		}
+
+		watched.insert(watched.end(), blueprint.sourceFiles.begin(), blueprint.sourceFiles.end());
+
+		try {
+			watcher->setFiles(watched);
+		}
+		catch (const std::exception &e) {
+			reportError(std::string(), "Watching for changes failed", e);
+			return 1;
+		}
+
+		buildImage(outputFile, blueprintFile, definitions, options, files, blockCache.get(), std::string());
+
+		if (blockCache)
+			blockCache->trim();
+
+		try {
+			printf("Watching %zu files for changes\n", watched.size());
+			fflush(stdout);
+
+			for (const auto &file : watcher->wait()) {
+				printf("Changed: %s\n", file.c_str());
+				files.invalidate(file);
+			}
+		}
+		catch (const std::exception &e) {
+			reportError(std::string(), "Watching for changes failed", e);
+			return 1;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	BuildOptions options;
+	const char *positional[2];
+	int positionalCount = 0;
+	std::string batchList;
+	Definitions definitions;
+	bool watch = false;
+
+	try {
+		for (int index = 1; index < argc; index++) {
+			std::string value;
+
+			if (argv[index][0] != '-') {
+				if (positionalCount == 2) {
+					usage(argv[0]);
+					return 1;
+				}
+
+				positional[positionalCount++] = argv[index];
+			}
+			else if (matchOption(argc, argv, index, "-D", "--define", value)) {
+				parseDefinition(value, definitions);
+			}
+			else if (matchOption(argc, argv, index, "-j", "--jobs", value)) {
+				options.jobs = std::stoul(value);
+			}
+			else if (matchOption(argc, argv, index, nullptr, "--cache", value)) {
+				options.cacheDirectory = value;
+			}
+			else if (matchOption(argc, argv, index, nullptr, "--block-cache", value)) {
+				options.blockCacheDirectory = value;
+			}
+			else if (matchOption(argc, argv, index, nullptr, "--max-memory", value)) {
+				options.maxMemory = parseSize(value);
+			}
+			else if (strcmp(argv[index], "-n") == 0 || strcmp(argv[index], "--dry-run") == 0) {
+				options.dryRun = true;
+			}
+			else if (strcmp(argv[index], "--verify") == 0) {
+				options.verify = true;
+			}
+			else if (strcmp(argv[index], "--boot-report") == 0) {
+				options.bootReport = true;
+			}
+			else if (matchOption(argc, argv, index, nullptr, "--boot-profile", value)) {
+				options.bootProfile.parse(value);
+				options.bootReport = true;
+			}
+			else if (matchOption(argc, argv, index, nullptr, "--batch", value)) {
+				batchList = value;
+			}
+			else if (strcmp(argv[index], "--watch") == 0) {
+				watch = true;
+			}
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	catch (const std::exception &e) {
+		fprintf(stderr, "Invalid command line: %s\n", e.what());
+		return 1;
+	}
+
+	if (!batchList.empty()) {
+		if (positionalCount != 0 || watch) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		return buildBatch(batchList, definitions, options);
+	}
+
+	if (positionalCount < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (watch)
+		return watchImage(positional[0], positional[1], definitions, options);
+
+	return buildImage(positional[0], positional[1], definitions, options, FileProvider::disk(), nullptr, std::string());
+}